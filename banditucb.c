@@ -7,61 +7,2360 @@
 #include <stdlib.h>
 #include <ctype.h>
 #include <math.h>
+#include <float.h>
 #include <string.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <limits.h>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define HAVE_X86_SIMD 1
+#include <immintrin.h>
+#endif
 
 static RedisModuleType *BanditUCBType;
 
-#define MAX_ARMS 64
+#define MAX_ARMS (1 << 24)
+
+/* Bandits with up to SMALL_ARMS arms keep one bit per arm in 64 bit masks
+ * and cache all their bounds. Larger ones use a tournament tree (ArmTree) */
+#define SMALL_ARMS 64
+
+#define CACHE_LINE 64
+
+/* Encodings of the arm state. Wide is uint64 counts and double means.
+ * Compact (small bandits only, opt-in with banditucb.compact) is uint32
+ * counts and float means, without the bounds cache. A compact bandit is
+ * promoted to wide when a count or a mean would not fit.
+ * Sparse (bandits with at least banditucb.sparse-arms arms) only keeps the
+ * arms with a count or a mean, in a SparseMap. The others are unpulled and
+ * PICK draws one of them at random by rejection. A sparse bandit is promoted
+ * to wide before the map holds half the arms, so draws take less than two
+ * tries on average and there is never a need for bounds */
+#define ENC_WIDE 0
+#define ENC_COMPACT 1
+#define ENC_SPARSE 2
+
+/* Past 2^24 pulls a float mean no longer moves with reward / count updates */
+#define COMPACT_MAX_COUNT (1 << 24)
+
+typedef uint32_t ARM;
+typedef uint64_t COUNT;
+
+/* Kinetic tournament tree over the arms of a large bandit, implicit like a
+ * binary heap: internal node i has children 2i and 2i+1, and an index
+ * j >= narms is the leaf for arm j - narms. Node 0 is unused, node 1 is the root.
+ * Each node holds one arm with the best value in its subtree and how many
+ * arms reach it, so ties can be broken uniformly at random walking down.
+ *
+ * With L = c * sqrt(log(t)) the bound of an arm is the line mean + L / sqrt(count)
+ * (treeArmLine), and only L changes when another arm is pulled. The tree is
+ * exact for its L: each node also keeps the smallest L at which the winner of
+ * a node in its subtree could be overtaken by the other child's, its
+ * certificate (minFail, rounded down to cover the rounding of values).
+ * Moving to a larger L (treeAdvance) only recomputes the nodes below a failed
+ * certificate and their ancestors, PICK costs O(log(narms)) amortized instead
+ * of re-evaluating every arm. An update recomputes the path from its arm to
+ * the root. A smaller or negative L, which only SET lowering counts or a
+ * negative c give, rebuilds the whole tree.
+ * Unpulled arms have an infinite value, NaN values count as -INFINITY */
+struct ArmNode {
+  ARM winner;
+  ARM ties;
+  float minFail; /* earliest certificate failure in the subtree */
+};
+typedef struct ArmNode ArmNode;
+
+/* Open addressing map with linear probing from arms to their count and mean.
+ * capacity is a power of two, kept at least twice size so probes stay short */
+#define SPARSE_EMPTY ((ARM)-1)
+#define SPARSE_MIN_CAPACITY 16
+
+struct SparseMap {
+  ARM capacity;
+  ARM size; /* arms in the map */
+  COUNT *counts;
+  double *means;
+  ARM *arms; /* SPARSE_EMPTY for free slots */
+};
+typedef struct SparseMap SparseMap;
+
+/* A pick waiting for its reward */
+struct PendingPull {
+  mstime_t expire;
+  ARM arm;
+};
+typedef struct PendingPull PendingPull;
+
+/* Picks not rewarded yet, kept while banditucb.pending-ttl is set.
+ * They count as pulls of their arm in bounds until an ADD to the arm resolves
+ * one or they expire. log(t) only counts rewarded pulls, so pending ones never
+ * move all bounds at once (see setTotalCount for before the first reward).
+ * Expiry is lazy, from a ring in pick order. An ADD resolves a pull of its
+ * arm right away and leaves the ring entry, counted in resolved, to be
+ * dropped when it expires.
+ * Counts are kept in slots, the slot of an arm is the arm itself, except for
+ * sparse bandits whose slots are an open addressing table like their map,
+ * with an arm while it has pending pulls or resolved entries, so they take
+ * memory for the arms picked rather than all arms. Free slots count 0.
+ * The ring holds banditucb.pending-max pulls at most (pendingMax), at most
+ * PENDING_MAX_PULLS, 256MB of ring. Picks past it are not kept */
+#define PENDING_MAX_PULLS (1 << 24)
+#define PENDING_MIN_SLOTS 16
+
+static long long pendingMax = 65536;
+
+struct PendingPulls {
+  ARM narms; /* arms with pending pulls */
+  ARM slots; /* entries of counts and resolved, a power of two if sparse */
+  ARM used; /* sparse only, slots holding an arm */
+  uint32_t head;
+  uint32_t size;
+  uint32_t capacity;
+  uint32_t *counts; /* pending pulls of the arm of each slot */
+  uint32_t *resolved; /* ring entries of the arm of each slot already resolved */
+  ARM *arms; /* sparse only, arm of each slot, SPARSE_EMPTY for free ones */
+  PendingPull *ring;
+};
+typedef struct PendingPulls PendingPulls;
+
+/* A pick made with a ticket, for REWARD to find its arm */
+struct Ticket {
+  uint64_t id; /* 0 once used */
+  mstime_t picked;
+  ARM arm;
+};
+typedef struct Ticket Ticket;
+
+/* Tickets of a bandit, ticket id is at id % capacity. Ids follow each other
+ * from a random start, so a ticket is forgotten when the ring wraps over it
+ * and tickets from before a restart are unlikely to match.
+ * Rings have up to TICKETS_MAX tickets, 1.5MB */
+#define TICKETS_MAX (1 << 16)
+
+struct TicketRing {
+  uint64_t next; /* id of the next ticket */
+  uint32_t capacity;
+  Ticket tickets[];
+};
+typedef struct TicketRing TicketRing;
+
+/* State of the picks of a bandit, apart from its header as most bandits
+ * never need it */
+struct PickState {
+  PendingPulls *pending; /* NULL unless picks were kept pending */
+  TicketRing *tickets; /* NULL until a pick asked for a ticket */
+};
+typedef struct PickState PickState;
+
+/* Large bandits also keep their unpulled arms in a dense array, updated with
+ * swap-remove, so a random one is drawn in O(1) during the warm-up */
+#define PULLED ((ARM)-1)
+
+struct ArmTree {
+  double L; /* c * sqrt(log(t)) the tree is valid for */
+  ARM nunpulled; /* unpulled[0..nunpulled) are the arms with a 0 count */
+  ARM *unpulled;
+  ARM *position; /* index of each arm in unpulled, PULLED if not there */
+  ArmNode nodes[]; /* narms entries, node 0 unused */
+};
+typedef struct ArmTree ArmTree;
+
+/* In-RAM data structure. counts and means have narms elements.
+ * The header, counts and means live in a single allocation: counts start right
+ * after the header and means follow them.
+ * Small bandits follow with bounds, which caches the UCB bounds, with best
+ * and ties describing the argmax. They are only valid for arms not set in dirty.
+ * Large bandits follow with their tree instead.
+ * Compact bandits have their uint32 counts and float means at the same place
+ * (compactCounts, compactMeans), counts, means and bounds are NULL and only
+ * best and ties are cached. Sparse bandits only have the header and their map.
+ * bounds, tree and map share their pointer, a bandit has one of them at most.
+ * Use armCount and armMean where any encoding can be.
+ * Pending pulls are apart, in the pick state, bounds and unpulled arms count
+ * them (armPulls). So are tickets */
+typedef struct BanditUCBObject BanditUCBObject;
+
+/* Computes the bounds, best bound and ties of a small bandit */
+typedef double (*BoundsKernel)(const BanditUCBObject *hto, double *bounds, uint64_t *ties);
+BoundsKernel boundsKernelFor(ARM narms, int encoding);
+
+struct BanditUCBObject {
+  ARM narms;
+  uint8_t encoding; /* ENC_WIDE, ENC_COMPACT or ENC_SPARSE */
+  double c; /* scaling constant for UCB */
+  COUNT total; /* sum of counts */
+  double logt; /* log(total), cached for computing bounds */
+  uint64_t unpulled; /* small only, bit i set while arm i has no pulls */
+  uint64_t dirty; /* small only, bit i set while bounds[i] is stale */
+  uint64_t ties; /* small only, arms with the best bound */
+  double best; /* small only, best bound */
+  COUNT* counts;
+  double* means;
+  union { /* one at most, by encoding and size */
+    double* bounds; /* small wide only */
+    ArmTree* tree; /* large wide only */
+    SparseMap *map; /* sparse only */
+  };
+  BoundsKernel kernel; /* small only, specialized for narms */
+  PickState *picks; /* NULL until picks are kept pending or get tickets */
+};
+
+static inline bool isSmallBandit(const BanditUCBObject *o) {
+  return o->narms <= SMALL_ARMS;
+}
+
+static inline PendingPulls *pendingOf(const BanditUCBObject *o) {
+  return o->picks == NULL ? NULL : o->picks->pending;
+}
+
+static inline TicketRing *ticketsOf(const BanditUCBObject *o) {
+  return o->picks == NULL ? NULL : o->picks->tickets;
+}
+
+/* The pick state of o, created empty when it has none */
+static inline PickState *pickState(BanditUCBObject *o) {
+  if (o->picks == NULL) {
+    o->picks = RedisModule_Alloc(sizeof(PickState));
+    o->picks->pending = NULL;
+    o->picks->tickets = NULL;
+  }
+  return o->picks;
+}
+
+/* round up to a whole number of cache lines */
+#define CACHE_LINE_ROUND(n) (((n) + CACHE_LINE - 1) & ~((size_t)CACHE_LINE - 1))
+
+/* Bit mask with the lowest narms bits set */
+static inline uint64_t armsMask(ARM narms) {
+    return narms == 64 ? ~(uint64_t)0 : ((uint64_t)1 << narms) - 1;
+}
+
+
+static inline uint32_t *compactCounts(const BanditUCBObject *o) {
+  return (uint32_t*)(o + 1);
+}
+
+static inline float *compactMeans(const BanditUCBObject *o) {
+  return (float*)(compactCounts(o) + o->narms);
+}
+
+/* Size of a map allocation, the arrays follow the header */
+static inline size_t sparseMapSize(ARM capacity) {
+  return sizeof(SparseMap) + (size_t)capacity * (sizeof(COUNT) + sizeof(double) + sizeof(ARM));
+}
+
+
+SparseMap *createSparseMap(ARM capacity) {
+  SparseMap *map = RedisModule_Alloc(sparseMapSize(capacity));
+  map->capacity = capacity;
+  map->size = 0;
+  map->counts = (COUNT*)(map + 1);
+  map->means = (double*)(map->counts + capacity);
+  map->arms = (ARM*)(map->means + capacity);
+  for (ARM i = 0; i < capacity; ++i) {
+    map->arms[i] = SPARSE_EMPTY;
+  }
+  return map;
+}
+
+
+static inline ARM sparseHash(ARM arm, ARM mask) {
+  return (ARM)((arm * 0x9e3779b97f4a7c15ULL) >> 32) & mask;
+}
+
+
+/* Slot of arm, or the free slot where it would go */
+static inline ARM sparseSlot(const SparseMap *map, ARM arm) {
+  const ARM mask = map->capacity - 1;
+  ARM i = sparseHash(arm, mask);
+  while (map->arms[i] != arm && map->arms[i] != SPARSE_EMPTY) {
+    i = (i + 1) & mask;
+  }
+  return i;
+}
+
+
+/* Slot of arm in p, for a sparse table the free slot where it would go
+ * when it has none */
+static inline ARM pendingSlot(const PendingPulls *p, ARM arm) {
+  if (p->arms == NULL) {
+    return arm;
+  }
+  const ARM mask = p->slots - 1;
+  ARM i = sparseHash(arm, mask);
+  while (p->arms[i] != arm && p->arms[i] != SPARSE_EMPTY) {
+    i = (i + 1) & mask;
+  }
+  return i;
+}
+
+
+static inline COUNT armCount(const BanditUCBObject *o, ARM arm) {
+  if (o->encoding == ENC_SPARSE) {
+    const ARM i = sparseSlot(o->map, arm);
+    return o->map->arms[i] == arm ? o->map->counts[i] : 0;
+  }
+  return o->encoding == ENC_COMPACT ? compactCounts(o)[arm] : o->counts[arm];
+}
+
+static inline double armMean(const BanditUCBObject *o, ARM arm) {
+  if (o->encoding == ENC_SPARSE) {
+    const ARM i = sparseSlot(o->map, arm);
+    return o->map->arms[i] == arm ? o->map->means[i] : 0.0;
+  }
+  return o->encoding == ENC_COMPACT ? compactMeans(o)[arm] : o->means[arm];
+}
+
+
+static inline COUNT pendingCount(const BanditUCBObject *o, ARM arm) {
+  const PendingPulls *p = pendingOf(o);
+  return p == NULL ? 0 : p->counts[pendingSlot(p, arm)];
+}
+
+/* Pulls of arm, rewarded or pending */
+static inline COUNT armPulls(const BanditUCBObject *o, ARM arm) {
+  return armCount(o, arm) + pendingCount(o, arm);
+}
+
+
+/* Whether o can hold count and mean for arm without being promoted.
+ * Means out of the float range only fit compact bandits if they are not
+ * finite anyway. A sparse bandit has room for arms in the map, or with a
+ * 0 count and mean, while the map stays under half the arms */
+static inline bool armFits(const BanditUCBObject *o, ARM arm, COUNT count, double mean) {
+  if (o->encoding == ENC_SPARSE) {
+    const SparseMap *map = o->map;
+    return map->arms[sparseSlot(map, arm)] == arm || (count == 0 && mean == 0.0) ||
+      2 * ((COUNT)map->size + 1) < o->narms;
+  }
+  if (o->encoding == ENC_WIDE) {
+    return true;
+  }
+  return count <= COMPACT_MAX_COUNT && (isfinite((float)mean) || !isfinite(mean));
+}
+
+
+/* Size of the single allocation backing an object with narms arms.
+ * Rounding to whole cache lines also gets the block cache line aligned
+ * from jemalloc, whose size classes are naturally aligned.
+ * Compact objects are not rounded, they are about density.
+ * Sparse objects are only the header, their map is allocated apart */
+size_t banditUCBObjectSize(ARM narms, int encoding) {
+  if (encoding == ENC_SPARSE) {
+    return sizeof(BanditUCBObject);
+  }
+  if (encoding == ENC_COMPACT) {
+    return sizeof(BanditUCBObject) + (size_t)narms * (sizeof(uint32_t) + sizeof(float));
+  }
+  size_t size = sizeof(BanditUCBObject) + (size_t)narms * (sizeof(COUNT) + sizeof(double));
+  if (narms <= SMALL_ARMS) {
+    size += narms * sizeof(double);
+  } else {
+    size += sizeof(ArmTree) + (size_t)narms * (sizeof(ArmNode) + 2 * sizeof(ARM));
+  }
+  return CACHE_LINE_ROUND(size);
+}
+
+
+/* Create, only partially initialised. Counts and means need to be zero'd or filled.
+ * Bounds start dirty, the tree needs a rebuild.
+ * The compact encoding is only for small bandits, sparse for large ones */
+BanditUCBObject *createBanditUCBObject(ARM narms, double c, int encoding) {
+    BanditUCBObject *o;
+    o = RedisModule_Alloc(banditUCBObjectSize(narms, encoding));
+    o->narms = narms;
+    o->encoding = encoding;
+    o->counts = NULL;
+    o->means = NULL;
+    o->bounds = NULL;
+    o->kernel = NULL;
+    o->picks = NULL;
+    if (encoding == ENC_SPARSE) {
+      o->map = createSparseMap(SPARSE_MIN_CAPACITY);
+    } else if (encoding == ENC_COMPACT) {
+      o->kernel = boundsKernelFor(narms, encoding);
+    } else if (isSmallBandit(o)) {
+      o->counts = (COUNT*)(o + 1);
+      o->means = (double*)(o->counts + narms);
+      o->bounds = o->means + narms;
+      o->kernel = boundsKernelFor(narms, encoding);
+    } else {
+      o->counts = (COUNT*)(o + 1);
+      o->means = (double*)(o->counts + narms);
+      o->tree = (ArmTree*)(o->means + narms);
+      o->tree->L = NAN;
+      o->tree->nunpulled = 0;
+      o->tree->unpulled = (ARM*)(o->tree->nodes + narms);
+      o->tree->position = o->tree->unpulled + narms;
+    }
+    o->c = c;
+    o->total = 0;
+    o->logt = log(0);
+    o->unpulled = 0;
+    o->dirty = isSmallBandit(o) ? armsMask(narms) : 0;
+    o->ties = 0;
+    o->best = -INFINITY;
+    return o;
+}
+
+
+/* Fast math (banditucb.fast-math config).
+ * The exploration term c * sqrt(log(t) / count) becomes c * sqrt(log(t)) times
+ * 1/sqrt(count) read from rsqrtTable, a float table for counts up to
+ * fastMathThreshold; higher counts are computed exactly. c * sqrt(log(t)) only
+ * needs computing once per bounds pass, saving a division and a sqrt per arm.
+ * Rounding 1/sqrt(count) to float gives the exploration term a relative error
+ * of at most 2^-24, about 6e-8, plus a few double roundings: under
+ * FAST_MATH_MAX_ERROR of it, means are exact */
+#define FAST_MATH_MAX_ERROR 1.2e-7
+
+static int fastMath = 0;
+static long long fastMathThreshold = 65536;
+/* Built for rsqrtTableMax, NULL while fast math is off. Bounds follow the
+ * table rather than fastMath, which is set before the table is built */
+static float *rsqrtTable = NULL;
+static COUNT rsqrtTableMax = 0;
+
+
+/* c * sqrt(log(t) / count), approximated with fast math.
+ * A bounds pass computes k = c * sqrt(log(t)) once and calls fastExploreTerm,
+ * which gives the same results as exploreTerm */
+static inline double fastExploreTerm(double k, double c, double logt, COUNT count) {
+    if (rsqrtTable != NULL && count <= rsqrtTableMax) {
+      return k * rsqrtTable[count];
+    }
+    return c * sqrt(logt / count);
+}
+
+static inline double exploreTerm(double c, double logt, COUNT count) {
+    if (rsqrtTable != NULL) {
+      return fastExploreTerm(c * sqrt(logt), c, logt, count);
+    }
+    return c * sqrt(logt / count);
+}
+
+
+/* A node seen from its parent: the line of its winner and its value at the
+ * L of the tree, the number of ties and the earliest failure below */
+struct TreeEntry {
+  double mean;
+  double slope;
+  double value;
+  ARM winner;
+  ARM ties;
+  float minFail;
+};
+typedef struct TreeEntry TreeEntry;
+
+
+/* Line of an arm, its value is mean + L * slope.
+ * Unpulled arms are a constant INFINITY, NaN means a constant -INFINITY */
+static inline void treeArmLine(const BanditUCBObject *o, ARM arm, double *mean, double *slope) {
+    const COUNT count = o->counts[arm] + pendingCount(o, arm);
+    if (count == 0 || isnan(o->means[arm])) {
+      *mean = count == 0 ? INFINITY : -INFINITY;
+      *slope = 0;
+      return;
+    }
+    *mean = o->means[arm];
+    *slope = 1.0 / sqrt((double)count);
+}
+
+
+/* Value of a line at L. NaN (from an infinite or NaN c) never wins */
+static inline double treeLineValue(double mean, double slope, double L) {
+    if (slope == 0) {
+      return mean;
+    }
+    const double value = mean + L * slope;
+    return isnan(value) ? -INFINITY : value;
+}
+
+
+/* Value of an arm at the L of the tree */
+static inline double treeArmValue(const BanditUCBObject *o, ARM arm) {
+    double mean, slope;
+    treeArmLine(o, arm, &mean, &slope);
+    return treeLineValue(mean, slope, o->tree->L);
+}
+
+
+/* Node i, which can be a leaf, as seen from its parent */
+static inline TreeEntry treeChild(const BanditUCBObject *o, ARM i) {
+    TreeEntry e;
+    if (i >= o->narms) {
+      e.winner = i - o->narms;
+      e.ties = 1;
+      e.minFail = INFINITY;
+    } else {
+      const ArmNode *node = &o->tree->nodes[i];
+      e.winner = node->winner;
+      e.ties = node->ties;
+      e.minFail = node->minFail;
+    }
+    treeArmLine(o, e.winner, &e.mean, &e.slope);
+    e.value = treeLineValue(e.mean, e.slope, o->tree->L);
+    return e;
+}
+
+
+/* Relative rounding error allowed for in comparisons and certificates */
+#define TREE_SLACK (4 * DBL_EPSILON)
+
+
+/* Order of two nodes at the L of the tree, > 0 if a is ahead, 0 on ties.
+ * Arms with the same count never change order as L moves, they compare by
+ * mean, so arms whose means only differ by rounding (same rewards in another
+ * order) tie for good instead of tying and untying with rounding of values.
+ * Infinite means have no rounding, they compare exactly */
+static inline int treeCompare(const TreeEntry *a, const TreeEntry *b) {
+    if (a->slope == b->slope) {
+      if (a->mean == b->mean ||
+	  (isfinite(a->mean) && isfinite(b->mean) &&
+	   fabs(a->mean - b->mean) <= TREE_SLACK * (fabs(a->mean) + fabs(b->mean)))) {
+	return 0;
+      }
+      return a->mean > b->mean ? 1 : -1;
+    }
+    return (a->value > b->value) - (a->value < b->value);
+}
+
+
+/* Smallest L >= 0 at which lose may catch up with win, which is ahead at L,
+ * INFINITY if it never does.
+ * Computed values carry rounding errors of a few ulps of |mean| + L * slope,
+ * so this is where the gap between the lines gets within TREE_SLACK of
+ * those, rounded down to a float: the certificate fails no later than the
+ * computed values can tie. Lines crossing right now get -INFINITY */
+static inline float treeFailure(const TreeEntry *win, const TreeEntry *lose, double L) {
+    if (win->slope == lose->slope || !isfinite(win->mean) || !isfinite(lose->mean)) {
+      return INFINITY;
+    }
+    const double gap = win->mean - lose->mean - TREE_SLACK * (fabs(win->mean) + fabs(lose->mean));
+    const double closing = lose->slope - win->slope + TREE_SLACK * (win->slope + lose->slope);
+    if (!(gap - L * closing > 0)) {
+      return -INFINITY;
+    }
+    if (!(closing > 0)) {
+      return INFINITY;
+    }
+    const double fail = gap / closing;
+    float rounded = (float)fail;
+    if (rounded > fail) {
+      rounded = nextafterf(rounded, -INFINITY);
+    }
+    return rounded;
+}
+
+
+/* Recompute internal node i from its children at the L of the tree.
+ * Tied children with different slopes separate as soon as L moves, so their
+ * certificate fails on the next advance */
+static inline void treeCombine(BanditUCBObject *o, ARM i) {
+    const TreeEntry left = treeChild(o, 2 * i);
+    const TreeEntry right = treeChild(o, 2 * i + 1);
+    ArmNode *node = &o->tree->nodes[i];
+    const int cmp = treeCompare(&left, &right);
+    float fail;
+    if (cmp > 0) {
+      node->winner = left.winner;
+      node->ties = left.ties;
+      fail = treeFailure(&left, &right, o->tree->L);
+    } else if (cmp < 0) {
+      node->winner = right.winner;
+      node->ties = right.ties;
+      fail = treeFailure(&right, &left, o->tree->L);
+    } else {
+      node->winner = left.winner;
+      node->ties = left.ties + right.ties;
+      fail = left.slope == right.slope || !isfinite(left.value) ? INFINITY : -INFINITY;
+    }
+    if (left.minFail < fail) {
+      fail = left.minFail;
+    }
+    if (right.minFail < fail) {
+      fail = right.minFail;
+    }
+    node->minFail = fail;
+}
+
+
+/* Recompute all nodes for the current log(t) */
+void treeRebuild(BanditUCBObject *o) {
+    o->tree->L = o->c * sqrt(o->logt);
+    for (ARM i = o->narms - 1; i >= 1; --i) {
+      treeCombine(o, i);
+    }
+}
+
+
+/* Recompute the nodes of the subtree of i whose certificate failed by the
+ * L of the tree, children first */
+static void treeAdvance(BanditUCBObject *o, ARM i) {
+    if (i >= o->narms || o->tree->nodes[i].minFail > o->tree->L) {
+      return;
+    }
+    treeAdvance(o, 2 * i);
+    treeAdvance(o, 2 * i + 1);
+    treeCombine(o, i);
+}
+
+
+/* An arm changed, recompute the path from its leaf to the root */
+static inline void treeUpdateArm(BanditUCBObject *o, ARM arm) {
+    for (ARM i = (o->narms + arm) / 2; i >= 1; i /= 2) {
+      treeCombine(o, i);
+    }
+}
+
+
+/* Put arm in or out of the unpulled array according to its pulls */
+static inline void treeUpdateUnpulled(BanditUCBObject *o, ARM arm) {
+    ArmTree *tree = o->tree;
+    const ARM pos = tree->position[arm];
+    if (o->counts[arm] + pendingCount(o, arm) == 0) {
+      if (pos == PULLED) {
+	tree->position[arm] = tree->nunpulled;
+	tree->unpulled[tree->nunpulled++] = arm;
+      }
+    } else if (pos != PULLED) {
+      const ARM last = tree->unpulled[--tree->nunpulled];
+      tree->unpulled[pos] = last;
+      tree->position[last] = pos;
+      tree->position[arm] = PULLED;
+    }
+}
+
+
+/* Refill the unpulled array from the pulls */
+void treeRebuildUnpulled(BanditUCBObject *o) {
+    ArmTree *tree = o->tree;
+    tree->nunpulled = 0;
+    for (ARM arm = 0; arm < o->narms; ++arm) {
+      tree->position[arm] = PULLED;
+      treeUpdateUnpulled(o, arm);
+    }
+}
+
+
+/* Bring the tree to the current log(t), advancing it when L grew */
+void treeRefresh(BanditUCBObject *o) {
+    ArmTree *tree = o->tree;
+    const double L = o->c * sqrt(o->logt);
+    if (L == tree->L) {
+      return;
+    }
+    if (L > tree->L && tree->L >= 0 && isfinite(L)) {
+      tree->L = L;
+      treeAdvance(o, 1);
+    } else {
+      treeRebuild(o);
+    }
+}
+
+
+/* Set the total count, keeping log(t) in sync.
+ * A new log(t) changes every bound.
+ * Before the first reward log(t) is log(0) and arms with only pending pulls
+ * would have NaN bounds, so while there are pending pulls it is log(narms)
+ * instead, as if every arm had been pulled once. Call again when pending
+ * pulls come or go */
+void setTotalCount(BanditUCBObject* o, COUNT total) {
+    const double logt = total == 0 && pendingOf(o) != NULL ? log(o->narms) : log(total);
+    if (logt != o->logt && isSmallBandit(o)) {
+      o->dirty = armsMask(o->narms);
+    }
+    o->total = total;
+    o->logt = logt;
+}
+
+
+/* Called when the count, pending pulls or mean of an arm change.
+ * For small bandits keeps the unpulled bit of the arm in sync with its pulls
+ * and marks its bound stale, for large ones updates the tree and the
+ * unpulled array */
+static inline void armUpdated(BanditUCBObject* o, ARM arm) {
+    if (o->encoding == ENC_SPARSE) {
+      return;
+    }
+    if (!isSmallBandit(o)) {
+      treeUpdateArm(o, arm);
+      treeUpdateUnpulled(o, arm);
+      return;
+    }
+    const uint64_t bit = (uint64_t)1 << arm;
+    o->dirty |= bit;
+    if (armPulls(o, arm) == 0) {
+      o->unpulled |= bit;
+    } else {
+      o->unpulled &= ~bit;
+    }
+}
+
+
+/* Set the count and mean of arm in the map of o, doubling it when it would
+ * be more than half full. Arms with a 0 count and mean are not inserted */
+void sparseSet(BanditUCBObject *o, ARM arm, COUNT count, double mean) {
+    SparseMap *map = o->map;
+    ARM i = sparseSlot(map, arm);
+    if (map->arms[i] == SPARSE_EMPTY) {
+      if (count == 0 && mean == 0.0) {
+	return;
+      }
+      if (2 * (map->size + 1) > map->capacity) {
+	SparseMap *grown = createSparseMap(2 * map->capacity);
+	for (ARM j = 0; j < map->capacity; ++j) {
+	  if (map->arms[j] != SPARSE_EMPTY) {
+	    const ARM k = sparseSlot(grown, map->arms[j]);
+	    grown->arms[k] = map->arms[j];
+	    grown->counts[k] = map->counts[j];
+	    grown->means[k] = map->means[j];
+	  }
+	}
+	grown->size = map->size;
+	RedisModule_Free(map);
+	o->map = map = grown;
+	i = sparseSlot(map, arm);
+      }
+      map->arms[i] = arm;
+      ++map->size;
+    }
+    map->counts[i] = count;
+    map->means[i] = mean;
+}
+
+
+/* Set the count and mean of an arm, keeping the total, bounds and tree in sync.
+ * They must fit (armFits) */
+void setArm(BanditUCBObject* o, ARM arm, COUNT count, double mean) {
+    setTotalCount(o, o->total - armCount(o, arm) + count);
+    if (o->encoding == ENC_SPARSE) {
+      sparseSet(o, arm, count, mean);
+    } else if (o->encoding == ENC_COMPACT) {
+      compactCounts(o)[arm] = count;
+      compactMeans(o)[arm] = mean;
+    } else {
+      o->counts[arm] = count;
+      o->means[arm] = mean;
+    }
+    armUpdated(o, arm);
+}
+
+
+/* Size of a pending pulls allocation, the slots follow the header */
+static inline size_t pendingSlotsSize(ARM slots, bool sparse) {
+    return sizeof(PendingPulls) + (size_t)slots * (2 * sizeof(uint32_t) + (sparse ? sizeof(ARM) : 0));
+}
+
+
+/* Empty pending pulls with slots slots, a table if sparse, without a ring */
+PendingPulls *createPendingPulls(ARM slots, bool sparse) {
+    PendingPulls *p = RedisModule_Alloc(pendingSlotsSize(slots, sparse));
+    p->narms = 0;
+    p->slots = slots;
+    p->used = 0;
+    p->head = 0;
+    p->size = 0;
+    p->capacity = 0;
+    p->counts = (uint32_t*)(p + 1);
+    p->resolved = p->counts + slots;
+    p->arms = sparse ? (ARM*)(p->resolved + slots) : NULL;
+    p->ring = NULL;
+    memset(p->counts, 0, 2 * (size_t)slots * sizeof(uint32_t));
+    if (sparse) {
+      for (ARM i = 0; i < slots; ++i) {
+	p->arms[i] = SPARSE_EMPTY;
+      }
+    }
+    return p;
+}
+
+
+void freePendingPulls(PendingPulls *p) {
+    RedisModule_Free(p->ring);
+    RedisModule_Free(p);
+}
+
+
+/* Move the ring and counts of from to the new slots of to, freeing from */
+static void movePendingPulls(PendingPulls *to, PendingPulls *from) {
+    for (ARM j = 0; j < from->slots; ++j) {
+      if (from->counts[j] == 0 && from->resolved[j] == 0) {
+	continue;
+      }
+      const ARM arm = from->arms == NULL ? j : from->arms[j];
+      const ARM k = pendingSlot(to, arm);
+      if (to->arms != NULL) {
+	to->arms[k] = arm;
+	++to->used;
+      }
+      to->counts[k] = from->counts[j];
+      to->resolved[k] = from->resolved[j];
+    }
+    to->narms = from->narms;
+    to->head = from->head;
+    to->size = from->size;
+    to->capacity = from->capacity;
+    to->ring = from->ring;
+    RedisModule_Free(from);
+}
+
+
+static inline size_t pendingPullsSize(const PendingPulls *p) {
+    if (p == NULL) {
+      return 0;
+    }
+    return pendingSlotsSize(p->slots, p->arms != NULL) + (size_t)p->capacity * sizeof(PendingPull);
+}
+
+
+void freePickState(PickState *picks) {
+    if (picks == NULL) {
+      return;
+    }
+    if (picks->pending != NULL) {
+      freePendingPulls(picks->pending);
+    }
+    RedisModule_Free(picks->tickets);
+    RedisModule_Free(picks);
+}
+
+
+/* Slot of arm in the pending pulls of o, taking a free one in a sparse
+ * table, which doubles when it would be more than half full */
+static ARM pendingAddSlot(BanditUCBObject *o, ARM arm) {
+    PendingPulls *p = o->picks->pending;
+    ARM i = pendingSlot(p, arm);
+    if (p->arms == NULL || p->arms[i] == arm) {
+      return i;
+    }
+    if (2 * (p->used + 1) > p->slots) {
+      PendingPulls *grown = createPendingPulls(2 * p->slots, true);
+      movePendingPulls(grown, p);
+      o->picks->pending = p = grown;
+      i = pendingSlot(p, arm);
+    }
+    p->arms[i] = arm;
+    ++p->used;
+    return i;
+}
+
+
+/* Free slot i of a sparse table once its arm has no pending pulls or
+ * resolved entries left. The slots after it in the probe run move back
+ * when they can, so lookups still reach them */
+static void pendingFreeSlot(PendingPulls *p, ARM i) {
+    if (p->arms == NULL || p->counts[i] != 0 || p->resolved[i] != 0) {
+      return;
+    }
+    const ARM mask = p->slots - 1;
+    for (ARM j = (i + 1) & mask; p->arms[j] != SPARSE_EMPTY; j = (j + 1) & mask) {
+      const ARM home = sparseHash(p->arms[j], mask);
+      // j stays if its home is in the run from after i to j
+      if (i < j ? (i < home && home <= j) : (i < home || home <= j)) {
+	continue;
+      }
+      p->arms[i] = p->arms[j];
+      p->counts[i] = p->counts[j];
+      p->resolved[i] = p->resolved[j];
+      i = j;
+    }
+    p->arms[i] = SPARSE_EMPTY;
+    p->counts[i] = 0;
+    p->resolved[i] = 0;
+    --p->used;
+}
+
+
+/* Whether used memory is over maxmemory. Picks are readonly commands, which
+ * maxmemory doesn't stop, so they check before keeping more state */
+static inline bool overMaxMemory(void) {
+    return RedisModule_GetUsedMemoryRatio != NULL && RedisModule_GetUsedMemoryRatio() > 1;
+}
+
+
+/* Count a pick of arm as a pull until expire, growing the ring when full.
+ * Picks are not kept once the ring has pendingMax pulls or while used
+ * memory is over maxmemory */
+void pendingPick(BanditUCBObject *o, ARM arm, mstime_t expire) {
+    if (overMaxMemory()) {
+      return;
+    }
+    PickState *picks = pickState(o);
+    if (picks->pending == NULL) {
+      picks->pending = o->encoding == ENC_SPARSE ? createPendingPulls(PENDING_MIN_SLOTS, true)
+	: createPendingPulls(o->narms, false);
+      setTotalCount(o, o->total);
+    }
+    PendingPulls *p = picks->pending;
+    if (p->size == p->capacity) {
+      if (p->capacity >= pendingMax) {
+	return;
+      }
+      uint32_t capacity = p->capacity == 0 ? 64 : 2 * p->capacity;
+      if (capacity > pendingMax) {
+	capacity = pendingMax;
+      }
+      PendingPull *ring = RedisModule_Alloc(capacity * sizeof(PendingPull));
+      for (uint32_t i = 0; i < p->size; ++i) {
+	ring[i] = p->ring[(p->head + i) % p->capacity];
+      }
+      RedisModule_Free(p->ring);
+      p->ring = ring;
+      p->head = 0;
+      p->capacity = capacity;
+    }
+    const ARM i = pendingAddSlot(o, arm);
+    p = picks->pending;
+    PendingPull *pull = &p->ring[(p->head + p->size) % p->capacity];
+    pull->expire = expire;
+    pull->arm = arm;
+    ++p->size;
+    if (p->counts[i]++ == 0) {
+      ++p->narms;
+    }
+    armUpdated(o, arm);
+}
+
+
+/* Drop the pending pulls expired at now */
+void pendingExpire(BanditUCBObject *o, mstime_t now) {
+    PendingPulls *p = o->picks->pending;
+    while (p->size != 0 && p->ring[p->head].expire <= now) {
+      const ARM arm = p->ring[p->head].arm;
+      const ARM i = pendingSlot(p, arm);
+      p->head = (p->head + 1) % p->capacity;
+      --p->size;
+      if (p->resolved[i] != 0) {
+	--p->resolved[i];
+	pendingFreeSlot(p, i);
+	continue;
+      }
+      if (--p->counts[i] == 0) {
+	--p->narms;
+	pendingFreeSlot(p, i);
+      }
+      armUpdated(o, arm);
+    }
+}
+
+
+/* n rewards of arm resolve as many of its pending pulls.
+ * The arm is not updated, setArm follows */
+static inline void pendingResolve(BanditUCBObject *o, ARM arm, COUNT n) {
+    PendingPulls *p = pendingOf(o);
+    if (p == NULL) {
+      return;
+    }
+    const ARM i = pendingSlot(p, arm);
+    if (p->counts[i] == 0) {
+      return;
+    }
+    const uint32_t resolved = n < p->counts[i] ? n : p->counts[i];
+    p->counts[i] -= resolved;
+    p->resolved[i] += resolved;
+    if (p->counts[i] == 0) {
+      --p->narms;
+    }
+}
+
+
+/* Zero counts and means */
+void zeroBanditUCBObject(BanditUCBObject* o) {    
+    freePickState(o->picks);
+    o->picks = NULL;
+    if (o->encoding == ENC_SPARSE) {
+      RedisModule_Free(o->map);
+      o->map = createSparseMap(SPARSE_MIN_CAPACITY);
+      setTotalCount(o, 0);
+      return;
+    }
+    if (o->encoding == ENC_COMPACT) {
+      for(uint32_t i = 0; i < o->narms; ++i)
+	compactCounts(o)[i] = 0;
+      for(uint32_t i = 0; i < o->narms; ++i)
+	compactMeans(o)[i] = 0.0f;
+    } else {
+      for(uint32_t i = 0; i < o->narms; ++i)
+	o->counts[i] = 0;
+      for(uint32_t i = 0; i < o->narms; ++i)
+	o->means[i] = 0.0;
+    }
+    setTotalCount(o, 0);
+    if (isSmallBandit(o)) {
+      o->unpulled = armsMask(o->narms);
+      o->dirty = armsMask(o->narms);
+    } else {
+      treeRebuild(o);
+      treeRebuildUnpulled(o);
+    }
+}
+
+
+/* Free memory */
+void BanditUCBReleaseObject(BanditUCBObject *o) {
+    freePickState(o->picks);
+    if (o->encoding == ENC_SPARSE) {
+      RedisModule_Free(o->map);
+    }
+    RedisModule_Free(o);
+}
+
+
+/* banditucb.compact, whether new small bandits start compact */
+static int compactEncoding = 0;
+
+/* banditucb.sparse-arms, number of arms from which new large bandits start
+ * sparse, 0 for never */
+static long long sparseArms = 65536;
+
+/* banditucb.pending-ttl, milliseconds PICK keeps its arm pending, 0 for off */
+static long long pendingTtl = 0;
+
+/* banditucb.tickets, size of the ticket ring of new bandits, and
+ * banditucb.ticket-ttl, milliseconds a ticket can be used for, 0 until the
+ * ring wraps */
+static long long ticketRingSize = 1024;
+static long long ticketTtl = 0;
+
+
+/* Bring the total, unpulled arms and tree of a wide bandit whose counts and
+ * means were filled in bulk in sync with them */
+void syncBanditUCBObject(BanditUCBObject *o) {
+    COUNT total = 0;
+    for (ARM i = 0; i < o->narms; ++i) {
+      total += o->counts[i];
+    }
+    setTotalCount(o, total);
+    if (isSmallBandit(o)) {
+      o->unpulled = 0;
+      for (ARM i = 0; i < o->narms; ++i) {
+	if (o->counts[i] + pendingCount(o, i) == 0) {
+	  o->unpulled |= (uint64_t)1 << i;
+	}
+      }
+    } else {
+      treeRebuild(o);
+      treeRebuildUnpulled(o);
+    }
+}
+
+
+/* A wide copy of the compact or sparse bandit o, its pick state moves to it,
+ * pending pulls with a slot per arm */
+BanditUCBObject *widenBanditUCBObject(BanditUCBObject *o) {
+    BanditUCBObject *wide = createBanditUCBObject(o->narms, o->c, ENC_WIDE);
+    if (pendingOf(o) != NULL && o->picks->pending->arms != NULL) {
+      PendingPulls *dense = createPendingPulls(o->narms, false);
+      movePendingPulls(dense, o->picks->pending);
+      o->picks->pending = dense;
+    }
+    wide->picks = o->picks;
+    o->picks = NULL;
+    if (o->encoding == ENC_SPARSE) {
+      for (ARM i = 0; i < o->narms; ++i) {
+	wide->counts[i] = 0;
+	wide->means[i] = 0.0;
+      }
+      const SparseMap *map = o->map;
+      for (ARM j = 0; j < map->capacity; ++j) {
+	if (map->arms[j] != SPARSE_EMPTY) {
+	  wide->counts[map->arms[j]] = map->counts[j];
+	  wide->means[map->arms[j]] = map->means[j];
+	}
+      }
+    } else {
+      for (ARM i = 0; i < o->narms; ++i) {
+	wide->counts[i] = armCount(o, i);
+	wide->means[i] = armMean(o, i);
+      }
+    }
+    syncBanditUCBObject(wide);
+    return wide;
+}
+
+
+/* Turn the compact or sparse bandit o, value of key, into a wide one, freeing o.
+ * Setting the new value drops the TTL of the key, so it is restored */
+BanditUCBObject *promoteBanditUCBObject(RedisModuleKey *key, BanditUCBObject *o) {
+    BanditUCBObject *wide = widenBanditUCBObject(o);
+
+    const mstime_t expire = RedisModule_GetExpire(key);
+    RedisModule_ModuleTypeSetValue(key, BanditUCBType, wide);
+    if (expire != REDISMODULE_NO_EXPIRE) {
+      RedisModule_SetExpire(key, expire);
+    }
+    return wide;
+}
+
+
+/* BANDITUCB.INIT <key> <narms> c
+ * Returns number of arms */
+int BanditUCBInit_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    RedisModule_AutoMemory(ctx); /* Use automatic memory management. */
+
+    if (argc != 4) return RedisModule_WrongArity(ctx);
+    RedisModuleKey *key = RedisModule_OpenKey(ctx,argv[1],
+        REDISMODULE_READ|REDISMODULE_WRITE);
+    int type = RedisModule_KeyType(key);
+    if (type != REDISMODULE_KEYTYPE_EMPTY &&
+        RedisModule_ModuleTypeGetType(key) != BanditUCBType)
+    {
+        return RedisModule_ReplyWithError(ctx,REDISMODULE_ERRORMSG_WRONGTYPE);
+    }
+
+    long long narms;
+    if ((RedisModule_StringToLongLong(argv[2],&narms) != REDISMODULE_OK)) {
+        return RedisModule_ReplyWithError(ctx,"ERR invalid value: narms must be a signed 64 bit integer");
+    }
+
+    if (narms <= 0) {
+      return RedisModule_ReplyWithError(ctx,"ERR invalid value: narms must be > 0");
+    }
+
+    if (narms > MAX_ARMS) {
+      return RedisModule_ReplyWithError(ctx,"ERR invalid value: too many arms");
+    }
+
+    double c;
+    if ((RedisModule_StringToDouble(argv[3], &c) != REDISMODULE_OK)) {
+      return RedisModule_ReplyWithError(ctx,"ERR invalid value: c must be a double");
+    }
+
+    /* Create an empty value object if the key is currently empty. */
+    BanditUCBObject *hto;
+    if (type == REDISMODULE_KEYTYPE_EMPTY) {
+      int encoding = ENC_WIDE;
+      if (narms <= SMALL_ARMS) {
+	encoding = compactEncoding ? ENC_COMPACT : ENC_WIDE;
+      } else if (sparseArms != 0 && narms >= sparseArms) {
+	encoding = ENC_SPARSE;
+      }
+      hto = createBanditUCBObject(narms, c, encoding);
+      RedisModule_ModuleTypeSetValue(key,BanditUCBType,hto);
+    } else {
+        hto = RedisModule_ModuleTypeGetValue(key);
+    }
+
+    zeroBanditUCBObject(hto);
+    RedisModule_SignalKeyAsReady(ctx,argv[1]);
+
+    RedisModule_ReplyWithLongLong(ctx, hto->narms);
+    RedisModule_ReplicateVerbatim(ctx);
+    return REDISMODULE_OK;
+}
+
+
+/* Add n rewards summing to sum to arm of hto, the value of key.
+ * The means are merged weighted by counts, for n = 1 it is the usual
+ * incremental update. They resolve pending pulls of the arm.
+ * Returns the value of key, a new object when hto had to be promoted */
+BanditUCBObject *addRewards(RedisModuleKey *key, BanditUCBObject *hto, ARM arm, COUNT n, double sum) {
+  const COUNT updated_count = armCount(hto, arm) + n;
+  double updated_mean;
+  if (updated_count == n) {
+    updated_mean = sum / n;
+  } else {
+    const double old_mean = armMean(hto, arm);
+    updated_mean = old_mean + (sum - n * old_mean) / updated_count;
+  }
+
+  if (!armFits(hto, arm, updated_count, updated_mean)) {
+    hto = promoteBanditUCBObject(key, hto);
+  }
+  pendingResolve(hto, arm, n);
+  setArm(hto, arm, updated_count, updated_mean);
+  return hto;
+}
+
+
+/* BANDITUCB.ADD <key> <arm> <reward>
+ * Returns updated count and mean */
+int BanditUCBAdd_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+  RedisModule_AutoMemory(ctx); /* Use automatic memory management. */
+
+  if (argc != 4) return RedisModule_WrongArity(ctx);
+
+  RedisModuleKey *key = RedisModule_OpenKey(ctx,argv[1],
+					    REDISMODULE_READ|REDISMODULE_WRITE);
+
+
+  int type = RedisModule_KeyType(key);
+  if (type != REDISMODULE_KEYTYPE_EMPTY &&
+      RedisModule_ModuleTypeGetType(key) != BanditUCBType)
+    {
+      return RedisModule_ReplyWithError(ctx,REDISMODULE_ERRORMSG_WRONGTYPE);
+    }
+
+  long long in_arm;
+  double reward;
+
+  if ((RedisModule_StringToLongLong(argv[2], &in_arm) != REDISMODULE_OK)) {
+    return RedisModule_ReplyWithError(ctx,"ERR invalid value: must be a signed 64 bit integer");
+  }
+
+  if ((RedisModule_StringToDouble(argv[3],&reward) != REDISMODULE_OK)) {
+    return RedisModule_ReplyWithError(ctx,"ERR invalid value: must be a double");
+  }
+
+  if (type == REDISMODULE_KEYTYPE_EMPTY) {
+    return RedisModule_ReplyWithError(ctx, "ERR bandit needs to be initialized first");
+  }
+
+  BanditUCBObject *hto = RedisModule_ModuleTypeGetValue(key);
+
+  if (in_arm < 0 || in_arm >= hto->narms) {
+    return RedisModule_ReplyWithError(ctx, "ERR invalid arm");
+  }
+
+  const ARM arm = in_arm;
+  hto = addRewards(key, hto, arm, 1, reward);
+
+  RedisModule_SignalKeyAsReady(ctx,argv[1]);
+
+  RedisModule_ReplyWithArray(ctx, 2);
+  RedisModule_ReplyWithLongLong(ctx, armCount(hto, arm));
+  RedisModule_ReplyWithDouble(ctx, armMean(hto, arm));
+
+  RedisModule_ReplicateVerbatim(ctx);
+  return REDISMODULE_OK;
+}
+
+
+/* ADDBLOB records, a little-endian uint32 arm then float64 reward */
+#define BLOB_RECORD_SIZE 12
+
+
+static inline uint32_t loadLE32(const char *p) {
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  v = __builtin_bswap32(v);
+#endif
+  return v;
+}
+
+
+static inline double loadLEDouble(const char *p) {
+  uint64_t v;
+  memcpy(&v, p, sizeof(v));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  v = __builtin_bswap64(v);
+#endif
+  double d;
+  memcpy(&d, &v, sizeof(d));
+  return d;
+}
+
+
+/* BANDITUCB.ADDBLOB <key> <records>
+ * Adds the rewards of records, packed 12 byte records (BLOB_RECORD_SIZE), in
+ * order as MADD would. Nothing is added unless all records are valid.
+ * Returns the number of rewards added */
+int BanditUCBAddBlob_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+  RedisModule_AutoMemory(ctx); /* Use automatic memory management. */
+
+  if (argc != 3) return RedisModule_WrongArity(ctx);
+
+  RedisModuleKey *key = RedisModule_OpenKey(ctx,argv[1],
+					    REDISMODULE_READ|REDISMODULE_WRITE);
+
+  int type = RedisModule_KeyType(key);
+  if (type != REDISMODULE_KEYTYPE_EMPTY &&
+      RedisModule_ModuleTypeGetType(key) != BanditUCBType)
+    {
+      return RedisModule_ReplyWithError(ctx,REDISMODULE_ERRORMSG_WRONGTYPE);
+    }
+
+  size_t len;
+  const char *records = RedisModule_StringPtrLen(argv[2], &len);
+  if (len == 0 || len % BLOB_RECORD_SIZE != 0) {
+    return RedisModule_ReplyWithError(ctx,"ERR invalid value: records must be 12 byte arm and reward pairs");
+  }
+
+  if (type == REDISMODULE_KEYTYPE_EMPTY) {
+    return RedisModule_ReplyWithError(ctx, "ERR bandit needs to be initialized first");
+  }
+
+  BanditUCBObject *hto = RedisModule_ModuleTypeGetValue(key);
+
+  const size_t nrecords = len / BLOB_RECORD_SIZE;
+  for (size_t i = 0; i < nrecords; ++i) {
+    const char *record = records + i * BLOB_RECORD_SIZE;
+    if (loadLE32(record) >= hto->narms) {
+      return RedisModule_ReplyWithError(ctx, "ERR invalid arm");
+    }
+    if (isnan(loadLEDouble(record + 4))) {
+      return RedisModule_ReplyWithError(ctx,"ERR invalid value: must be a double");
+    }
+  }
+
+  for (size_t i = 0; i < nrecords; ++i) {
+    const char *record = records + i * BLOB_RECORD_SIZE;
+    hto = addRewards(key, hto, loadLE32(record), 1, loadLEDouble(record + 4));
+  }
+
+  RedisModule_SignalKeyAsReady(ctx,argv[1]);
+
+  RedisModule_ReplyWithLongLong(ctx, nrecords);
+
+  RedisModule_ReplicateVerbatim(ctx);
+  return REDISMODULE_OK;
+}
+
+
+/* BANDITUCB.ADDAGG <key> <arm> <n> <sum>
+ * Adds n rewards summing to sum, as n ADD would up to rounding.
+ * Returns updated count and mean */
+int BanditUCBAddAgg_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+  RedisModule_AutoMemory(ctx); /* Use automatic memory management. */
+
+  if (argc != 5) return RedisModule_WrongArity(ctx);
+
+  RedisModuleKey *key = RedisModule_OpenKey(ctx,argv[1],
+					    REDISMODULE_READ|REDISMODULE_WRITE);
+
+  int type = RedisModule_KeyType(key);
+  if (type != REDISMODULE_KEYTYPE_EMPTY &&
+      RedisModule_ModuleTypeGetType(key) != BanditUCBType)
+    {
+      return RedisModule_ReplyWithError(ctx,REDISMODULE_ERRORMSG_WRONGTYPE);
+    }
+
+  long long in_arm;
+  long long n;
+  double sum;
+
+  if ((RedisModule_StringToLongLong(argv[2], &in_arm) != REDISMODULE_OK)) {
+    return RedisModule_ReplyWithError(ctx,"ERR invalid value: must be a signed 64 bit integer");
+  }
+
+  if ((RedisModule_StringToLongLong(argv[3], &n) != REDISMODULE_OK)) {
+    return RedisModule_ReplyWithError(ctx,"ERR invalid value: must be a signed 64 bit integer");
+  }
+
+  if ((RedisModule_StringToDouble(argv[4],&sum) != REDISMODULE_OK)) {
+    return RedisModule_ReplyWithError(ctx,"ERR invalid value: must be a double");
+  }
+
+  if (n <= 0) {
+    return RedisModule_ReplyWithError(ctx,"ERR invalid value: n must be > 0");
+  }
+
+  if (type == REDISMODULE_KEYTYPE_EMPTY) {
+    return RedisModule_ReplyWithError(ctx, "ERR bandit needs to be initialized first");
+  }
+
+  BanditUCBObject *hto = RedisModule_ModuleTypeGetValue(key);
+
+  if (in_arm < 0 || in_arm >= hto->narms) {
+    return RedisModule_ReplyWithError(ctx, "ERR invalid arm");
+  }
+
+  const ARM arm = in_arm;
+  if (armCount(hto, arm) > UINT64_MAX - (COUNT)n) {
+    return RedisModule_ReplyWithError(ctx, "ERR count overflow");
+  }
+  hto = addRewards(key, hto, arm, n, sum);
+
+  RedisModule_SignalKeyAsReady(ctx,argv[1]);
+
+  RedisModule_ReplyWithArray(ctx, 2);
+  RedisModule_ReplyWithLongLong(ctx, armCount(hto, arm));
+  RedisModule_ReplyWithDouble(ctx, armMean(hto, arm));
+
+  RedisModule_ReplicateVerbatim(ctx);
+  return REDISMODULE_OK;
+}
+
+
+/* BANDITUCB.MADD <key> <arm> <reward> [<arm> <reward> ...]
+ * Adds the rewards in order, as many ADD would. Nothing is added unless
+ * all pairs are valid.
+ * Returns the number of rewards added */
+int BanditUCBMAdd_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+  RedisModule_AutoMemory(ctx); /* Use automatic memory management. */
+
+  if (argc < 4 || argc % 2 != 0) return RedisModule_WrongArity(ctx);
+
+  RedisModuleKey *key = RedisModule_OpenKey(ctx,argv[1],
+					    REDISMODULE_READ|REDISMODULE_WRITE);
+
+  int type = RedisModule_KeyType(key);
+  if (type != REDISMODULE_KEYTYPE_EMPTY &&
+      RedisModule_ModuleTypeGetType(key) != BanditUCBType)
+    {
+      return RedisModule_ReplyWithError(ctx,REDISMODULE_ERRORMSG_WRONGTYPE);
+    }
+
+  if (type == REDISMODULE_KEYTYPE_EMPTY) {
+    return RedisModule_ReplyWithError(ctx, "ERR bandit needs to be initialized first");
+  }
+
+  BanditUCBObject *hto = RedisModule_ModuleTypeGetValue(key);
+
+  const int npairs = (argc - 2) / 2;
+  ARM *arms = RedisModule_PoolAlloc(ctx, npairs * sizeof(ARM));
+  double *rewards = RedisModule_PoolAlloc(ctx, npairs * sizeof(double));
+  for (int i = 0; i < npairs; ++i) {
+    long long in_arm;
+    if ((RedisModule_StringToLongLong(argv[2 + 2 * i], &in_arm) != REDISMODULE_OK)) {
+      return RedisModule_ReplyWithError(ctx,"ERR invalid value: must be a signed 64 bit integer");
+    }
+    if ((RedisModule_StringToDouble(argv[3 + 2 * i], &rewards[i]) != REDISMODULE_OK)) {
+      return RedisModule_ReplyWithError(ctx,"ERR invalid value: must be a double");
+    }
+    if (in_arm < 0 || in_arm >= hto->narms) {
+      return RedisModule_ReplyWithError(ctx, "ERR invalid arm");
+    }
+    arms[i] = in_arm;
+  }
+
+  for (int i = 0; i < npairs; ++i) {
+    hto = addRewards(key, hto, arms[i], 1, rewards[i]);
+  }
+
+  RedisModule_SignalKeyAsReady(ctx,argv[1]);
+
+  RedisModule_ReplyWithLongLong(ctx, npairs);
+
+  RedisModule_ReplicateVerbatim(ctx);
+  return REDISMODULE_OK;
+}
+
+
+/* BANDITUCB.MADDKEYS <key> <arm> <reward> [<key> <arm> <reward> ...]
+ * Adds the rewards in order, as many ADD would, to possibly different keys.
+ * Nothing is added unless all triples are valid. Keys are opened again to
+ * add as a reward can promote the object of a key repeated later on.
+ * Returns the number of rewards added */
+int BanditUCBMAddKeys_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+  RedisModule_AutoMemory(ctx); /* Use automatic memory management. */
+
+  if (argc < 4 || (argc - 1) % 3 != 0) return RedisModule_WrongArity(ctx);
+
+  const int ntriples = (argc - 1) / 3;
+  ARM *arms = RedisModule_PoolAlloc(ctx, ntriples * sizeof(ARM));
+  double *rewards = RedisModule_PoolAlloc(ctx, ntriples * sizeof(double));
+  for (int i = 0; i < ntriples; ++i) {
+    RedisModuleKey *key = RedisModule_OpenKey(ctx,argv[1 + 3 * i],
+					      REDISMODULE_READ|REDISMODULE_WRITE);
+    const int type = RedisModule_KeyType(key);
+    if (type != REDISMODULE_KEYTYPE_EMPTY &&
+	RedisModule_ModuleTypeGetType(key) != BanditUCBType)
+      {
+	return RedisModule_ReplyWithError(ctx,REDISMODULE_ERRORMSG_WRONGTYPE);
+      }
+
+    if (type == REDISMODULE_KEYTYPE_EMPTY) {
+      return RedisModule_ReplyWithError(ctx, "ERR bandit needs to be initialized first");
+    }
+
+    const BanditUCBObject *hto = RedisModule_ModuleTypeGetValue(key);
+    RedisModule_CloseKey(key);
+
+    long long in_arm;
+    if ((RedisModule_StringToLongLong(argv[2 + 3 * i], &in_arm) != REDISMODULE_OK)) {
+      return RedisModule_ReplyWithError(ctx,"ERR invalid value: must be a signed 64 bit integer");
+    }
+    if ((RedisModule_StringToDouble(argv[3 + 3 * i], &rewards[i]) != REDISMODULE_OK)) {
+      return RedisModule_ReplyWithError(ctx,"ERR invalid value: must be a double");
+    }
+    if (in_arm < 0 || in_arm >= hto->narms) {
+      return RedisModule_ReplyWithError(ctx, "ERR invalid arm");
+    }
+    arms[i] = in_arm;
+  }
+
+  for (int i = 0; i < ntriples; ++i) {
+    RedisModuleKey *key = RedisModule_OpenKey(ctx,argv[1 + 3 * i],
+					      REDISMODULE_READ|REDISMODULE_WRITE);
+    addRewards(key, RedisModule_ModuleTypeGetValue(key), arms[i], 1, rewards[i]);
+    RedisModule_CloseKey(key);
+    RedisModule_SignalKeyAsReady(ctx,argv[1 + 3 * i]);
+  }
+
+  RedisModule_ReplyWithLongLong(ctx, ntriples);
+
+  RedisModule_ReplicateVerbatim(ctx);
+  return REDISMODULE_OK;
+}
+
+
+/* BANDITUCB.SET <key> <arm> <count> <mean>
+ * Reply with count and mean */
+int BanditUCBSet_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+  RedisModule_AutoMemory(ctx); /* Use automatic memory management. */
+
+  if (argc != 5) return RedisModule_WrongArity(ctx);
+
+  RedisModuleKey *key = RedisModule_OpenKey(ctx,argv[1],
+					    REDISMODULE_READ|REDISMODULE_WRITE);
+  int type = RedisModule_KeyType(key);
+  if (type != REDISMODULE_KEYTYPE_EMPTY &&
+      RedisModule_ModuleTypeGetType(key) != BanditUCBType)
+    {
+      return RedisModule_ReplyWithError(ctx,REDISMODULE_ERRORMSG_WRONGTYPE);
+    }
+
+  long long arm;
+  long long count;
+  double mean;
+
+  if ((RedisModule_StringToLongLong(argv[2], &arm) != REDISMODULE_OK)) {
+    return RedisModule_ReplyWithError(ctx,"ERR invalid value: arm must be an unsigned 64 bit integer");
+  }
+
+  if ((RedisModule_StringToLongLong(argv[3] ,&count) != REDISMODULE_OK)) {
+    return RedisModule_ReplyWithError(ctx,"ERR invalid value: count must be an unsigned 64 bit integer");
+  }
+
+  if ((RedisModule_StringToDouble(argv[4], &mean) != REDISMODULE_OK)) {
+    return RedisModule_ReplyWithError(ctx,"ERR invalid value: total must be a double");
+  }
+
+  if (type == REDISMODULE_KEYTYPE_EMPTY) {
+    return RedisModule_ReplyWithError(ctx, "ERR bandit needs to be initialized first");
+  }
+
+  BanditUCBObject *hto = RedisModule_ModuleTypeGetValue(key);
+
+  if (arm < 0 || arm >= hto->narms) {
+    return RedisModule_ReplyWithError(ctx, "ERR invalid arm");
+  }
+
+  if (!armFits(hto, arm, count, mean)) {
+    hto = promoteBanditUCBObject(key, hto);
+  }
+  setArm(hto, arm, count, mean);
+
+  RedisModule_SignalKeyAsReady(ctx, argv[1]);
+  
+  RedisModule_ReplyWithArray(ctx, 2);
+  RedisModule_ReplyWithLongLong(ctx, armCount(hto, arm));
+  RedisModule_ReplyWithDouble(ctx, armMean(hto, arm));
+
+  RedisModule_ReplicateVerbatim(ctx);
+  return REDISMODULE_OK;
+}
+
+
+/* xoshiro256** generator state. The pick path takes it as an argument
+ * rather than using a global one, so callers choose the sequence they draw
+ * from (picks are otherwise main thread only, see pickArm) */
+struct RandState {
+  uint64_t s[4];
+};
+typedef struct RandState RandState;
+
+/* Generator used by commands (on the main thread), seeded from the server's
+ * random bytes or from the seed config when it is not 0, for reproducible runs */
+static RandState moduleRng;
+static long long rngSeed = 0;
+
+
+static inline uint64_t rotl64(const uint64_t x, int k) {
+  return (x << k) | (x >> (64 - k));
+}
+
+
+/* next 64 random bits */
+static inline uint64_t randNext(RandState *rng) {
+  uint64_t *st = rng->s;
+  const uint64_t result = rotl64(st[1] * 5, 7) * 9;
+  const uint64_t t = st[1] << 17;
+  st[2] ^= st[0];
+  st[3] ^= st[1];
+  st[1] ^= st[2];
+  st[0] ^= st[3];
+  st[2] ^= t;
+  st[3] = rotl64(st[3], 45);
+  return result;
+}
+
+
+/* Seed the generator. A 0 seed takes random bytes from the server,
+ * others are expanded with splitmix64 so that close seeds diverge */
+void randSeed(RandState *rng, uint64_t seed) {
+  uint64_t *st = rng->s;
+  if (seed == 0) {
+    do {
+      RedisModule_GetRandomBytes((unsigned char*)st, sizeof(rng->s));
+    } while ((st[0] | st[1] | st[2] | st[3]) == 0);
+    return;
+  }
+  for (int i = 0; i < 4; ++i) {
+    uint64_t z = (seed += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    st[i] = z ^ (z >> 31);
+  }
+}
+
+
+/* draw from [0,n( evenly distributed, n > 0.
+ * Lemire's multiply and shift, rejecting the few values that would bias it */
+uint32_t randInt(RandState *rng, uint32_t n) {
+  uint64_t m = (randNext(rng) >> 32) * (uint64_t)n;
+  uint32_t low = (uint32_t)m;
+  if (low < n) {
+    const uint32_t threshold = -n % n;
+    while (low < threshold) {
+      m = (randNext(rng) >> 32) * (uint64_t)n;
+      low = (uint32_t)m;
+    }
+  }
+  return m >> 32;
+}
+
+
+/* position of the n-th (from 0) set bit of x, x must have more than n bits set.
+ * Branch-light binary search on popcounts of halves, no loop */
+static inline ARM selectBit(uint64_t x, int n) {
+  ARM pos = 0;
+  int c;
+  c = __builtin_popcountll(x & 0xffffffffULL);
+  if (n >= c) { n -= c; pos += 32; x >>= 32; }
+  c = __builtin_popcountll(x & 0xffffULL);
+  if (n >= c) { n -= c; pos += 16; x >>= 16; }
+  c = __builtin_popcountll(x & 0xffULL);
+  if (n >= c) { n -= c; pos += 8; x >>= 8; }
+  c = __builtin_popcountll(x & 0xfULL);
+  if (n >= c) { n -= c; pos += 4; x >>= 4; }
+  c = __builtin_popcountll(x & 0x3ULL);
+  if (n >= c) { n -= c; pos += 2; x >>= 2; }
+  c = x & 1;
+  if (n >= c) { pos += 1; }
+  return pos;
+}
+
+
+/* Pick a winner of the tree, uniformly among ties.
+ * Walks down from the root choosing a tied child in proportion to its ties */
+ARM treePick(const BanditUCBObject *o, RandState *rng) {
+  const ArmNode *nodes = o->tree->nodes;
+  if (nodes[1].ties == 1) {
+    return nodes[1].winner;
+  }
+  ARM r = randInt(rng, nodes[1].ties);
+  ARM i = 1;
+  while (i < o->narms) {
+    const TreeEntry left = treeChild(o, 2 * i);
+    const TreeEntry right = treeChild(o, 2 * i + 1);
+    const int cmp = treeCompare(&left, &right);
+    if (cmp > 0 || (cmp == 0 && r < left.ties)) {
+      i = 2 * i;
+      continue;
+    }
+    if (cmp == 0) {
+      r -= left.ties;
+    }
+    i = 2 * i + 1;
+  }
+  return i - o->narms;
+}
+
+
+/* sum counts */
+COUNT sumcounts(const COUNT *counts, uint64_t n) {
+  uint64_t t = 0;
+  for (ARM i = 0; i < n; ++i) {
+    t += counts[i];
+  }
+  return t;
+}
+
+
+/* UCB bound of one arm, pending pulls included */
+static inline double armBound(const BanditUCBObject *hto, ARM i) {
+  return armMean(hto, i) + exploreTerm(hto->c, hto->logt, armPulls(hto, i));
+}
+
+
+/* Bound kernels.
+ * Each computes the UCB bounds of all arms into bounds, returns the best
+ * bound and sets ties to the mask of arms reaching it, all in one pass.
+ * They evaluate mean + c * sqrt(log(t) / count) with the same operations in
+ * the same order, so every kernel produces bit-identical bounds.
+ * Fast kernels evaluate mean + fastExploreTerm(count) instead, reading the
+ * rsqrtTable for counts up to rsqrtTableMax and falling back to the exact
+ * term above, and agree with each other and with armBound the same way.
+ * NaN bounds are never best, same as with a plain > comparison.
+ *
+ * Kernels are written as bodies taking the number of arms and whether to use
+ * fast math, always inlined into a generic kernel and into kernels for 2, 4,
+ * 8, 16 and 32 arms (KERNEL_SIZES) where the constants let the compiler drop
+ * the tail handling and the unused term and peel the loop completely */
+#define KERNEL_BODY static inline __attribute__((always_inline))
+
+/* Portable kernel, also used for platforms without SIMD kernels */
+KERNEL_BODY double boundsKernelScalarBody(const BanditUCBObject *hto, const ARM narms,
+					  const bool fast, double *bounds, uint64_t *ties) {
+  const double logt = hto->logt;
+  const double k = hto->c * sqrt(logt);
+  double best = -INFINITY;
+  uint64_t mask = 0;
+  for(ARM i=0; i < narms; ++i) {
+    const double z = fast ? fastExploreTerm(k, hto->c, logt, hto->counts[i])
+      : hto->c * sqrt(logt / hto->counts[i]);
+    const double mean = hto->means[i];
+    const double bound = mean + z;
+    bounds[i] = bound;
+    if (bound > best) {
+      best = bound;
+      mask = 0;
+    }
+    if (bound == best) {
+      mask |= (uint64_t)1 << i;
+    }
+  }
+  *ties = mask;
+  return best;
+}
+
+
+/* Generic and fixed size kernels from a body, the generic ones are
+ * boundsKernel<isa> and boundsKernel<isa>Fast, the others have _<narms>
+ * appended */
+#define KERNEL_SIZED(isa, attrs, suffix, n)				\
+  attrs static double boundsKernel##isa##suffix(const BanditUCBObject *hto, \
+						double *bounds, uint64_t *ties) { \
+    return boundsKernel##isa##Body(hto, n, false, bounds, ties);	\
+  }									\
+  attrs static double boundsKernel##isa##Fast##suffix(const BanditUCBObject *hto, \
+						      double *bounds, uint64_t *ties) { \
+    return boundsKernel##isa##Body(hto, n, true, bounds, ties);		\
+  }
+
+/* GCC only peels the fixed size loops completely when asked, clang does it
+ * by itself and would warn about the attribute */
+#if defined(__GNUC__) && !defined(__clang__)
+#define KERNEL_PEEL __attribute__((optimize("peel-loops")))
+#else
+#define KERNEL_PEEL
+#endif
+
+#define KERNEL_SIZES(isa, attrs)			\
+  KERNEL_SIZED(isa, attrs, , hto->narms)		\
+  KERNEL_SIZED(isa, attrs KERNEL_PEEL, _2, 2)		\
+  KERNEL_SIZED(isa, attrs KERNEL_PEEL, _4, 4)		\
+  KERNEL_SIZED(isa, attrs KERNEL_PEEL, _8, 8)		\
+  KERNEL_SIZED(isa, attrs KERNEL_PEEL, _16, 16)		\
+  KERNEL_SIZED(isa, attrs KERNEL_PEEL, _32, 32)
+
+/* Kernels for each size, generic first */
+#define KERNEL_SIZE_CLASSES 6
+
+/* Tables of the kernels of an isa, exact and fast */
+#define KERNEL_TABLES(name, isa)					\
+  static const BoundsKernel name##Kernels[KERNEL_SIZE_CLASSES] = {	\
+    boundsKernel##isa, boundsKernel##isa##_2, boundsKernel##isa##_4,	\
+    boundsKernel##isa##_8, boundsKernel##isa##_16, boundsKernel##isa##_32 \
+  };									\
+  static const BoundsKernel name##FastKernels[KERNEL_SIZE_CLASSES] = {	\
+    boundsKernel##isa##Fast, boundsKernel##isa##Fast_2, boundsKernel##isa##Fast_4, \
+    boundsKernel##isa##Fast_8, boundsKernel##isa##Fast_16, boundsKernel##isa##Fast_32 \
+  };
+
+KERNEL_SIZES(Scalar, )
+
+
+/* Compact bandits widen counts and means first so their bounds are the ones
+ * of a wide bandit holding the same values */
+static double boundsKernelCompact(const BanditUCBObject *hto, double *bounds, uint64_t *ties) {
+  const uint32_t *counts = compactCounts(hto);
+  const float *means = compactMeans(hto);
+  const double logt = hto->logt;
+  double best = -INFINITY;
+  uint64_t mask = 0;
+  for(ARM i=0; i < hto->narms; ++i) {
+    const double z = hto->c * sqrt(logt / (COUNT)counts[i]);
+    const double mean = means[i];
+    const double bound = mean + z;
+    bounds[i] = bound;
+    if (bound > best) {
+      best = bound;
+      mask = 0;
+    }
+    if (bound == best) {
+      mask |= (uint64_t)1 << i;
+    }
+  }
+  *ties = mask;
+  return best;
+}
+
+/* Fast math for compact bandits, see fastExploreTerm */
+static double boundsKernelCompactFast(const BanditUCBObject *hto, double *bounds, uint64_t *ties) {
+  const uint32_t *counts = compactCounts(hto);
+  const float *means = compactMeans(hto);
+  const double k = hto->c * sqrt(hto->logt);
+  double best = -INFINITY;
+  uint64_t mask = 0;
+  for(ARM i=0; i < hto->narms; ++i) {
+    const double z = fastExploreTerm(k, hto->c, hto->logt, counts[i]);
+    const double mean = means[i];
+    const double bound = mean + z;
+    bounds[i] = bound;
+    if (bound > best) {
+      best = bound;
+      mask = 0;
+    }
+    if (bound == best) {
+      mask |= (uint64_t)1 << i;
+    }
+  }
+  *ties = mask;
+  return best;
+}
+
+KERNEL_TABLES(scalar, Scalar)
+
+
+#ifdef HAVE_X86_SIMD
+
+/* The SIMD kernels keep a best bound and a tie mask per lane, lane j covering
+ * arms j, j + lanes, j + 2*lanes... and merge the lanes at the end.
+ * Lanes past narms get a -INFINITY bound and their bits are masked off */
+
+/* uint64 to double without AVX-512DQ, exact below 2^53 and correctly rounded
+ * above: the high and low 32 bits become two exact doubles whose sum is
+ * rounded once */
+#define U64_TO_DOUBLE_MAGIC_HI 19342813113834066795298816. /* 2^84 */
+#define U64_TO_DOUBLE_MAGIC_LO 4503599627370496. /* 2^52 */
+
+static inline __m128d u64ToDoubleSSE2(__m128i x) {
+  const __m128i lo32 = _mm_set1_epi64x(0xffffffffLL);
+  __m128i hi = _mm_or_si128(_mm_srli_epi64(x, 32),
+			    _mm_castpd_si128(_mm_set1_pd(U64_TO_DOUBLE_MAGIC_HI)));
+  __m128i lo = _mm_or_si128(_mm_and_si128(x, lo32),
+			    _mm_castpd_si128(_mm_set1_pd(U64_TO_DOUBLE_MAGIC_LO)));
+  __m128d f = _mm_sub_pd(_mm_castsi128_pd(hi),
+			 _mm_set1_pd(U64_TO_DOUBLE_MAGIC_HI + U64_TO_DOUBLE_MAGIC_LO));
+  return _mm_add_pd(f, _mm_castsi128_pd(lo));
+}
+
+
+/* SSE2 is baseline on x86-64, two arms per step */
+KERNEL_BODY double boundsKernelSSE2Body(const BanditUCBObject *hto, const ARM narms,
+					const bool fast, double *bounds, uint64_t *ties) {
+  const double k = hto->c * sqrt(hto->logt);
+  const __m128d logt = _mm_set1_pd(hto->logt);
+  const __m128d c = _mm_set1_pd(hto->c);
+  const __m128d neginf = _mm_set1_pd(-INFINITY);
+  __m128d best = neginf;
+  __m128i mask = _mm_setzero_si128();
+  __m128i bit = _mm_set_epi64x(2, 1);
+
+  for(ARM i=0; i < narms; i += 2) {
+    __m128i n;
+    __m128d mean;
+    __m128d live;
+    if (i + 2 <= narms) {
+      n = _mm_loadu_si128((const __m128i*)(hto->counts + i));
+      mean = _mm_loadu_pd(hto->means + i);
+      live = _mm_castsi128_pd(_mm_set1_epi64x(-1));
+    } else {
+      n = _mm_loadl_epi64((const __m128i*)(hto->counts + i));
+      mean = _mm_load_sd(hto->means + i);
+      live = _mm_castsi128_pd(_mm_set_epi64x(0, -1));
+    }
+    __m128d z;
+    if (fast) {
+      // no 64-bit compares nor gathers in SSE2, each lane on its own
+      const COUNT hi = i + 2 <= narms ? hto->counts[i + 1] : 1;
+      z = _mm_set_pd(fastExploreTerm(k, hto->c, hto->logt, hi),
+		     fastExploreTerm(k, hto->c, hto->logt, hto->counts[i]));
+    } else {
+      z = _mm_mul_pd(c, _mm_sqrt_pd(_mm_div_pd(logt, u64ToDoubleSSE2(n))));
+    }
+    __m128d b = _mm_add_pd(mean, z);
+    b = _mm_or_pd(_mm_and_pd(live, b), _mm_andnot_pd(live, neginf));
+    if (i + 2 <= narms) {
+      _mm_storeu_pd(bounds + i, b);
+    } else {
+      _mm_store_sd(bounds + i, b);
+    }
+
+    const __m128i gt = _mm_castpd_si128(_mm_cmpgt_pd(b, best));
+    const __m128i eq = _mm_castpd_si128(_mm_cmpeq_pd(b, best));
+    const __m128i tied = _mm_or_si128(mask, _mm_and_si128(bit, eq));
+    mask = _mm_or_si128(_mm_and_si128(gt, bit), _mm_andnot_si128(gt, tied));
+    best = _mm_max_pd(b, best);
+    bit = _mm_slli_epi64(bit, 2);
+  }
+
+  double lbest[2];
+  uint64_t lmask[2];
+  _mm_storeu_pd(lbest, best);
+  _mm_storeu_si128((__m128i*)lmask, mask);
+  const double g = lbest[0] > lbest[1] ? lbest[0] : lbest[1];
+  *ties = ((lbest[0] == g ? lmask[0] : 0) | (lbest[1] == g ? lmask[1] : 0)) & armsMask(narms);
+  return g;
+}
+
+
+__attribute__((target("avx2")))
+static inline __m256d u64ToDoubleAVX2(__m256i x) {
+  const __m256i lo32 = _mm256_set1_epi64x(0xffffffffLL);
+  __m256i hi = _mm256_or_si256(_mm256_srli_epi64(x, 32),
+			       _mm256_castpd_si256(_mm256_set1_pd(U64_TO_DOUBLE_MAGIC_HI)));
+  __m256i lo = _mm256_or_si256(_mm256_and_si256(x, lo32),
+			       _mm256_castpd_si256(_mm256_set1_pd(U64_TO_DOUBLE_MAGIC_LO)));
+  __m256d f = _mm256_sub_pd(_mm256_castsi256_pd(hi),
+			    _mm256_set1_pd(U64_TO_DOUBLE_MAGIC_HI + U64_TO_DOUBLE_MAGIC_LO));
+  return _mm256_add_pd(f, _mm256_castsi256_pd(lo));
+}
+
+
+/* AVX2, four arms per step, masked loads for the tail */
+__attribute__((target("avx2")))
+KERNEL_BODY double boundsKernelAVX2Body(const BanditUCBObject *hto, const ARM narms,
+					const bool fast, double *bounds, uint64_t *ties) {
+  const __m256d k = _mm256_set1_pd(hto->c * sqrt(hto->logt));
+  // unsigned compares are signed ones with the sign bit flipped
+  const __m256i sign = _mm256_set1_epi64x(INT64_MIN);
+  const __m256i tableMax = _mm256_xor_si256(_mm256_set1_epi64x(rsqrtTableMax), sign);
+  const __m256d logt = _mm256_set1_pd(hto->logt);
+  const __m256d c = _mm256_set1_pd(hto->c);
+  const __m256d neginf = _mm256_set1_pd(-INFINITY);
+  const __m256i lanes = _mm256_setr_epi64x(0, 1, 2, 3);
+  __m256d best = neginf;
+  __m256i mask = _mm256_setzero_si256();
+  __m256i bit = _mm256_setr_epi64x(1, 2, 4, 8);
+
+  for(ARM i=0; i < narms; i += 4) {
+    __m256i n;
+    __m256d mean;
+    __m256i live;
+    if (i + 4 <= narms) {
+      live = _mm256_set1_epi64x(-1);
+      n = _mm256_loadu_si256((const __m256i*)(hto->counts + i));
+      mean = _mm256_loadu_pd(hto->means + i);
+    } else {
+      live = _mm256_cmpgt_epi64(_mm256_set1_epi64x(narms - i), lanes);
+      n = _mm256_maskload_epi64((const long long*)(hto->counts + i), live);
+      mean = _mm256_maskload_pd(hto->means + i, live);
+    }
+    __m256d z;
+    if (fast) {
+      // lanes past the table read rsqrtTable[0] and get the exact term
+      const __m256i over = _mm256_cmpgt_epi64(_mm256_xor_si256(n, sign), tableMax);
+      uint64_t idx[4];
+      _mm256_storeu_si256((__m256i*)idx, _mm256_andnot_si256(over, n));
+      const __m128 r = _mm_setr_ps(rsqrtTable[idx[0]], rsqrtTable[idx[1]],
+				   rsqrtTable[idx[2]], rsqrtTable[idx[3]]);
+      z = _mm256_mul_pd(k, _mm256_cvtps_pd(r));
+      if (!_mm256_testz_si256(over, over)) {
+	const __m256d exact = _mm256_mul_pd(c, _mm256_sqrt_pd(_mm256_div_pd(logt, u64ToDoubleAVX2(n))));
+	z = _mm256_blendv_pd(z, exact, _mm256_castsi256_pd(over));
+      }
+    } else {
+      z = _mm256_mul_pd(c, _mm256_sqrt_pd(_mm256_div_pd(logt, u64ToDoubleAVX2(n))));
+    }
+    __m256d b = _mm256_blendv_pd(neginf, _mm256_add_pd(mean, z), _mm256_castsi256_pd(live));
+    _mm256_maskstore_pd(bounds + i, live, b);
+
+    const __m256i gt = _mm256_castpd_si256(_mm256_cmp_pd(b, best, _CMP_GT_OQ));
+    const __m256i eq = _mm256_castpd_si256(_mm256_cmp_pd(b, best, _CMP_EQ_OQ));
+    const __m256i tied = _mm256_or_si256(mask, _mm256_and_si256(bit, eq));
+    mask = _mm256_blendv_epi8(tied, bit, gt);
+    best = _mm256_max_pd(b, best);
+    bit = _mm256_slli_epi64(bit, 4);
+  }
+
+  double lbest[4];
+  uint64_t lmask[4];
+  _mm256_storeu_pd(lbest, best);
+  _mm256_storeu_si256((__m256i*)lmask, mask);
+  double g = lbest[0];
+  for (int j = 1; j < 4; ++j) {
+    if (lbest[j] > g) g = lbest[j];
+  }
+  uint64_t m = 0;
+  for (int j = 0; j < 4; ++j) {
+    if (lbest[j] == g) m |= lmask[j];
+  }
+  *ties = m & armsMask(narms);
+  return g;
+}
+
+
+/* AVX-512 (F and DQ for the uint64 conversion), eight arms per step */
+__attribute__((target("avx512f,avx512dq")))
+KERNEL_BODY double boundsKernelAVX512Body(const BanditUCBObject *hto, const ARM narms,
+					  const bool fast, double *bounds, uint64_t *ties) {
+  const __m512d k = _mm512_set1_pd(hto->c * sqrt(hto->logt));
+  const __m512i tableMax = _mm512_set1_epi64(rsqrtTableMax);
+  const __m512d logt = _mm512_set1_pd(hto->logt);
+  const __m512d c = _mm512_set1_pd(hto->c);
+  const __m512d neginf = _mm512_set1_pd(-INFINITY);
+  __m512d best = neginf;
+  __m512i mask = _mm512_setzero_si512();
+  __m512i bit = _mm512_setr_epi64(1, 2, 4, 8, 16, 32, 64, 128);
+
+  for(ARM i=0; i < narms; i += 8) {
+    const __mmask8 live = narms - i >= 8 ? 0xff : (__mmask8)((1u << (narms - i)) - 1);
+    const __m512i n = _mm512_maskz_loadu_epi64(live, hto->counts + i);
+    const __m512d mean = _mm512_maskz_loadu_pd(live, hto->means + i);
+    __m512d z;
+    if (fast) {
+      const __mmask8 over = _mm512_cmpgt_epu64_mask(n, tableMax);
+      const __m256 r = _mm512_mask_i64gather_ps(_mm256_setzero_ps(), (__mmask8)~over, n,
+						rsqrtTable, 4);
+      z = _mm512_mul_pd(k, _mm512_cvtps_pd(r));
+      if (over != 0) {
+	const __m512d exact = _mm512_mul_pd(c, _mm512_sqrt_pd(_mm512_div_pd(logt, _mm512_cvtepu64_pd(n))));
+	z = _mm512_mask_mov_pd(z, over, exact);
+      }
+    } else {
+      z = _mm512_mul_pd(c, _mm512_sqrt_pd(_mm512_div_pd(logt, _mm512_cvtepu64_pd(n))));
+    }
+    const __m512d b = _mm512_mask_add_pd(neginf, live, mean, z);
+    _mm512_mask_storeu_pd(bounds + i, live, b);
+
+    const __mmask8 gt = _mm512_cmp_pd_mask(b, best, _CMP_GT_OQ);
+    const __mmask8 eq = _mm512_cmp_pd_mask(b, best, _CMP_EQ_OQ);
+    mask = _mm512_mask_or_epi64(mask, eq, mask, bit);
+    mask = _mm512_mask_mov_epi64(mask, gt, bit);
+    best = _mm512_mask_mov_pd(best, gt, b);
+    bit = _mm512_slli_epi64(bit, 8);
+  }
 
-typedef uint32_t ARM;
-typedef uint64_t COUNT;
+  const double g = _mm512_reduce_max_pd(best);
+  const __mmask8 winners = _mm512_cmp_pd_mask(best, _mm512_set1_pd(g), _CMP_EQ_OQ);
+  *ties = (uint64_t)_mm512_mask_reduce_or_epi64(winners, mask) & armsMask(narms);
+  return g;
+}
 
-/* In-RAM data structure. counts and means have narms elements */
-struct BanditUCBObject {
-  ARM narms;
-  double c; /* scaling constant for UCB */
-  COUNT* counts;
-  double* means;
-};
-typedef struct BanditUCBObject BanditUCBObject;
+KERNEL_SIZES(SSE2, )
+KERNEL_SIZES(AVX2, __attribute__((target("avx2"))))
+KERNEL_SIZES(AVX512, __attribute__((target("avx512f,avx512dq"))))
 
-/* Create, only partially initialised. Counts and means need to be zero'd or filled */
-BanditUCBObject *createBanditUCBObject(ARM narms, double c) {
-    BanditUCBObject *o;
-    o = RedisModule_Alloc(sizeof(*o));
-    o->narms = narms;
-    o->counts = RedisModule_Alloc(narms * sizeof(COUNT));
-    o->means = RedisModule_Alloc(narms * sizeof(double));
-    o->c = c;
-    return o;
+KERNEL_TABLES(sse2, SSE2)
+KERNEL_TABLES(avx2, AVX2)
+KERNEL_TABLES(avx512, AVX512)
+
+#endif
+
+
+/* chosen at module load according to CPU features */
+static const BoundsKernel *boundsKernels = scalarKernels;
+static const BoundsKernel *fastBoundsKernels = scalarFastKernels;
+static const char *boundsKernelName = "scalar";
+
+
+/* Pick the widest kernels the CPU supports */
+void selectBoundsKernels(void) {
+#ifdef HAVE_X86_SIMD
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512dq")) {
+    boundsKernels = avx512Kernels;
+    fastBoundsKernels = avx512FastKernels;
+    boundsKernelName = "avx512";
+  } else if (__builtin_cpu_supports("avx2")) {
+    boundsKernels = avx2Kernels;
+    fastBoundsKernels = avx2FastKernels;
+    boundsKernelName = "avx2";
+  } else {
+    boundsKernels = sse2Kernels;
+    fastBoundsKernels = sse2FastKernels;
+    boundsKernelName = "sse2";
+  }
+#endif
 }
 
 
-/* Zero counts and means */
-void zeroBanditUCBObject(BanditUCBObject* o) {    
-    for(uint32_t i = 0; i < o->narms; ++i)
-      o->counts[i] = 0;
-    for(uint32_t i = 0; i < o->narms; ++i)
-      o->means[i] = 0.0;
+/* Index of the kernels for narms arms in the tables, fixed size when there
+ * is one */
+static inline int kernelSizeClass(ARM narms) {
+  switch (narms) {
+  case 2: return 1;
+  case 4: return 2;
+  case 8: return 3;
+  case 16: return 4;
+  case 32: return 5;
+  default: return 0;
+  }
 }
 
+/* Kernel for a small bandit with narms arms */
+BoundsKernel boundsKernelFor(ARM narms, int encoding) {
+  if (encoding == ENC_COMPACT) {
+    return boundsKernelCompact;
+  }
+  return boundsKernels[kernelSizeClass(narms)];
+}
 
-/* Free memory */
-void BanditUCBReleaseObject(BanditUCBObject *o) {
-    RedisModule_Free(o->counts);
-    RedisModule_Free(o->means);
-    RedisModule_Free(o);
+/* Same with fast math, only while rsqrtTable is there */
+static BoundsKernel fastBoundsKernelFor(ARM narms, int encoding) {
+  if (encoding == ENC_COMPACT) {
+    return boundsKernelCompactFast;
+  }
+  return fastBoundsKernels[kernelSizeClass(narms)];
 }
 
 
-/* BANDITUCB.INIT <key> <narms> c
- * Returns number of arms */
-int BanditUCBInit_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+/* Bring the cached bounds, best bound and ties of a small bandit up to date.
+ * When log(t) changed all arms are dirty and the kernel redoes everything,
+ * otherwise (after SET kept the total) only dirty arms are recomputed and
+ * the argmax is found again from the cached bounds.
+ * Compact bandits have no bounds to keep, the kernel redoes everything.
+ * Kernels ignore pending pulls, with them arms are computed one by one */
+void refreshBounds(BanditUCBObject *hto) {
+  if (hto->dirty == 0) {
+    return;
+  }
+
+  // kernels only know rewarded pulls
+  if (pendingOf(hto) == NULL) {
+    const BoundsKernel kernel = rsqrtTable != NULL
+      ? fastBoundsKernelFor(hto->narms, hto->encoding) : hto->kernel;
+
+    if (hto->encoding == ENC_COMPACT) {
+      double bounds[SMALL_ARMS];
+      hto->best = kernel(hto, bounds, &hto->ties);
+      hto->dirty = 0;
+      return;
+    }
+
+    if (hto->dirty == armsMask(hto->narms)) {
+      hto->best = kernel(hto, hto->bounds, &hto->ties);
+      hto->dirty = 0;
+      return;
+    }
+  }
+
+  double buffer[SMALL_ARMS];
+  double *bounds = hto->bounds;
+  uint64_t dirty = hto->dirty;
+  if (hto->encoding == ENC_COMPACT) {
+    bounds = buffer;
+    dirty = armsMask(hto->narms);
+  }
+  for (uint64_t d = dirty; d != 0; d &= d - 1) {
+    const ARM i = __builtin_ctzll(d);
+    bounds[i] = armBound(hto, i);
+  }
+  double best = -INFINITY;
+  uint64_t ties = 0;
+  for (ARM i = 0; i < hto->narms; ++i) {
+    const double bound = bounds[i];
+    if (bound > best) {
+      best = bound;
+      ties = 0;
+    }
+    if (bound == best) {
+      ties |= (uint64_t)1 << i;
+    }
+  }
+  hto->best = best;
+  hto->ties = ties;
+  hto->dirty = 0;
+}
+
+
+/* pickArm in one pass over all arms, drawing among unpulled arms or ties
+ * by reservoir sampling */
+static bool pickArmScan(BanditUCBObject *hto, RandState *rng, ARM *arm) {
+    ARM nunpulled = 0, nties = 0;
+    double best = -INFINITY;
+    for (ARM i = 0; i < hto->narms; ++i) {
+      if (armPulls(hto, i) == 0) {
+	if (randInt(rng, ++nunpulled) == 0) {
+	  *arm = i;
+	}
+	continue;
+      }
+      if (nunpulled != 0) {
+	continue;
+      }
+      const double bound = armBound(hto, i);
+      if (bound > best) {
+	best = bound;
+	nties = 0;
+      }
+      if (bound == best && randInt(rng, ++nties) == 0) {
+	*arm = i;
+      }
+    }
+    return nunpulled != 0 || nties != 0;
+}
+
+
+/* Choose the arm to pull.
+ * While there are unpulled arms one of them is drawn at random.
+ * Then the arm with the best UCB bound is chosen, drawing at random among ties.
+ * For small bandits this is served from the cached bounds, refreshed in one
+ * kernel pass when stale; the tied arms are a mask so a single random number
+ * picks one, rather than reservoir sampling that would need one per tie.
+ * Large bandits draw unpulled arms from their unpulled array, then walk down
+ * their tree. Sparse bandits have more than half of their arms unpulled and
+ * draw arms until one is, unless pending pulls took too many of them, then
+ * they look at all arms.
+ * Randomness comes from rng. It refreshes the cached bounds or the tree of
+ * hto and reads the fast math config, so like any command it belongs on the
+ * main thread.
+ * Returns false if no arm has a usable bound (all NaN) */
+bool pickArm(BanditUCBObject *hto, RandState *rng, ARM *arm) {
+    if (hto->encoding == ENC_SPARSE) {
+      const COUNT npulled = hto->map->size + (pendingOf(hto) == NULL ? 0 : hto->picks->pending->narms);
+      if (2 * npulled >= hto->narms) {
+	return pickArmScan(hto, rng, arm);
+      }
+      do {
+	*arm = randInt(rng, hto->narms);
+      } while (armPulls(hto, *arm) != 0);
+      return true;
+    }
+    if (!isSmallBandit(hto)) {
+      const ArmTree *tree = hto->tree;
+      if (tree->nunpulled != 0) {
+	*arm = tree->unpulled[randInt(rng, tree->nunpulled)];
+	return true;
+      }
+      treeRefresh(hto);
+      *arm = treePick(hto, rng);
+      return true;
+    }
+
+    if (hto->unpulled != 0) {
+      const uint64_t unpulled = hto->unpulled;
+      const int nunpulled = __builtin_popcountll(unpulled);
+      *arm = nunpulled == 1 ? (ARM)__builtin_ctzll(unpulled)
+	: selectBit(unpulled, randInt(rng, nunpulled));
+      return true;
+    }
+
+    // it's floating point but ties are not necessarily zero probability
+    // so all arms reaching the best bound are kept.
+    refreshBounds(hto);
+    const uint64_t ties = hto->ties;
+    const int nchoices = __builtin_popcountll(ties);
+    if (nchoices == 0) {
+      return false;
+    }
+    if (nchoices == 1) {
+      // only 1 option, no need to draw at random
+      *arm = __builtin_ctzll(ties);
+    } else {
+      *arm = selectBit(ties, randInt(rng, nchoices));
+    }
+    return true;
+}
+
+
+/* Whether arg is the option name, in any case. name is upper case */
+static bool isOption(RedisModuleString *arg, const char *name) {
+    size_t len;
+    const char *s = RedisModule_StringPtrLen(arg, &len);
+    if (len != strlen(name)) {
+      return false;
+    }
+    for (size_t i = 0; i < len; ++i) {
+      if (toupper((unsigned char)s[i]) != name[i]) {
+	return false;
+      }
+    }
+    return true;
+}
+
+
+/* Drop the expired pending pulls of hto, and the pending pulls themselves
+ * once they are all gone while banditucb.pending-ttl is off */
+void expirePendingPulls(BanditUCBObject *hto, mstime_t now) {
+    if (pendingOf(hto) == NULL) {
+      return;
+    }
+    pendingExpire(hto, now);
+    if (pendingTtl == 0 && hto->picks->pending->size == 0) {
+      freePendingPulls(hto->picks->pending);
+      hto->picks->pending = NULL;
+      if (hto->picks->tickets == NULL) {
+	freePickState(hto->picks);
+	hto->picks = NULL;
+      }
+      setTotalCount(hto, hto->total);
+    }
+}
+
+
+/* pickArm for PICK and MPICK, with banditucb.pending-ttl the arm picked is
+ * pending until rewarded or expired */
+bool pickArmPending(BanditUCBObject *hto, ARM *arm) {
+    if (pendingOf(hto) == NULL && pendingTtl == 0) {
+      return pickArm(hto, &moduleRng, arm);
+    }
+    const mstime_t now = RedisModule_Milliseconds();
+    expirePendingPulls(hto, now);
+    if (!pickArm(hto, &moduleRng, arm)) {
+      return false;
+    }
+    if (pendingTtl != 0) {
+      pendingPick(hto, *arm, now + pendingTtl);
+    }
+    return true;
+}
+
+
+/* With banditucb.pending-ttl count n picks of arm made at now as pending,
+ * for PICKN and PICKBATCH which pick several arms at once */
+void pendingPicks(BanditUCBObject *hto, ARM arm, COUNT n, mstime_t now) {
+    if (pendingTtl == 0) {
+      return;
+    }
+    for (COUNT i = 0; i < n; ++i) {
+      pendingPick(hto, arm, now + pendingTtl);
+    }
+}
+
+
+/* Record a pick of arm at now, returns its ticket id */
+uint64_t ticketPick(BanditUCBObject *hto, ARM arm, mstime_t now) {
+    PickState *picks = pickState(hto);
+    if (picks->tickets == NULL) {
+      picks->tickets = RedisModule_Alloc(sizeof(TicketRing) + ticketRingSize * sizeof(Ticket));
+      picks->tickets->next = (randNext(&moduleRng) >> 2) + 1;
+      picks->tickets->capacity = ticketRingSize;
+      for (uint32_t i = 0; i < picks->tickets->capacity; ++i) {
+	picks->tickets->tickets[i].id = 0;
+      }
+    }
+    TicketRing *ring = picks->tickets;
+    const uint64_t id = ring->next++;
+    Ticket *ticket = &ring->tickets[id % ring->capacity];
+    ticket->id = id;
+    ticket->picked = now;
+    ticket->arm = arm;
+    return id;
+}
+
+
+/* The ticket id of hto if it is still valid at now, NULL otherwise */
+Ticket *ticketFind(BanditUCBObject *hto, uint64_t id, mstime_t now) {
+    TicketRing *ring = ticketsOf(hto);
+    if (ring == NULL || id == 0) {
+      return NULL;
+    }
+    Ticket *ticket = &ring->tickets[id % ring->capacity];
+    if (ticket->id != id || (ticketTtl != 0 && now - ticket->picked > ticketTtl)) {
+      return NULL;
+    }
+    return ticket;
+}
+
+
+/* BANDITUCB.PICK <key> [TICKET]
+ * Reply with the picked arm.
+ * With TICKET reply with the arm and a ticket REWARD takes instead of it.
+ * pick is non-deterministic (breaking ties) but that's OK as it doesn't change any state
+ * other than refreshing cached bounds and pending pulls, which are neither
+ * persisted nor replicated */
+int BanditUCBPick_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
     RedisModule_AutoMemory(ctx); /* Use automatic memory management. */
 
-    if (argc != 4) return RedisModule_WrongArity(ctx);
+    if (argc != 2 && argc != 3) return RedisModule_WrongArity(ctx);
     RedisModuleKey *key = RedisModule_OpenKey(ctx,argv[1],
         REDISMODULE_READ|REDISMODULE_WRITE);
     int type = RedisModule_KeyType(key);
@@ -71,45 +2370,44 @@ int BanditUCBInit_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, in
         return RedisModule_ReplyWithError(ctx,REDISMODULE_ERRORMSG_WRONGTYPE);
     }
 
-    long long narms;
-    if ((RedisModule_StringToLongLong(argv[2],&narms) != REDISMODULE_OK)) {
-        return RedisModule_ReplyWithError(ctx,"ERR invalid value: narms must be a signed 64 bit integer");
+    const bool withTicket = argc == 3;
+    if (withTicket && !isOption(argv[2], "TICKET")) {
+      return RedisModule_ReplyWithError(ctx,"ERR syntax error");
     }
 
-    if (narms == 0) {
-      return RedisModule_ReplyWithError(ctx,"ERR invalid value: narms must be > 0");
+    if (type == REDISMODULE_KEYTYPE_EMPTY) {
+          return RedisModule_ReplyWithError(ctx, "ERR bandit needs to be initialized first");
     }
 
-    if (narms > MAX_ARMS) {
-      return RedisModule_ReplyWithError(ctx,"ERR invalid value: too many arms");
-    }
+    struct BanditUCBObject *hto = RedisModule_ModuleTypeGetValue(key);
 
-    double c;
-    if ((RedisModule_StringToDouble(argv[3], &c) != REDISMODULE_OK)) {
-      return RedisModule_ReplyWithError(ctx,"ERR invalid value: c must be a double");
+    if (withTicket && ticketsOf(hto) == NULL && overMaxMemory()) {
+      return RedisModule_ReplyWithError(ctx,"OOM command not allowed when used memory > 'maxmemory'");
     }
 
-    /* Create an empty value object if the key is currently empty. */
-    BanditUCBObject *hto;
-    if (type == REDISMODULE_KEYTYPE_EMPTY) {
-      hto = createBanditUCBObject(narms, c);
-      RedisModule_ModuleTypeSetValue(key,BanditUCBType,hto);
-    } else {
-        hto = RedisModule_ModuleTypeGetValue(key);
+    ARM arm;
+    if (!pickArmPending(hto, &arm)) {
+      return RedisModule_ReplyWithError(ctx,"no choices");
     }
 
-    zeroBanditUCBObject(hto);
-    RedisModule_SignalKeyAsReady(ctx,argv[1]);
+    if (withTicket) {
+      RedisModule_ReplyWithArray(ctx, 2);
+      RedisModule_ReplyWithLongLong(ctx, arm);
+      RedisModule_ReplyWithLongLong(ctx, ticketPick(hto, arm, RedisModule_Milliseconds()));
+      return REDISMODULE_OK;
+    }
 
-    RedisModule_ReplyWithLongLong(ctx, hto->narms);
-    RedisModule_ReplicateVerbatim(ctx);
+    RedisModule_ReplyWithLongLong(ctx, arm);
+    
     return REDISMODULE_OK;
 }
 
 
-/* BANDITUCB.ADD <key> <arm> <reward>
+/* BANDITUCB.REWARD <key> <ticket> <reward>
+ * Adds reward to the arm picked with ticket, which can only be used once.
+ * Tickets are not persisted, it replicates as the ADD it does.
  * Returns updated count and mean */
-int BanditUCBAdd_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+int BanditUCBReward_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
   RedisModule_AutoMemory(ctx); /* Use automatic memory management. */
 
   if (argc != 4) return RedisModule_WrongArity(ctx);
@@ -117,7 +2415,6 @@ int BanditUCBAdd_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int
   RedisModuleKey *key = RedisModule_OpenKey(ctx,argv[1],
 					    REDISMODULE_READ|REDISMODULE_WRITE);
 
-
   int type = RedisModule_KeyType(key);
   if (type != REDISMODULE_KEYTYPE_EMPTY &&
       RedisModule_ModuleTypeGetType(key) != BanditUCBType)
@@ -125,10 +2422,10 @@ int BanditUCBAdd_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int
       return RedisModule_ReplyWithError(ctx,REDISMODULE_ERRORMSG_WRONGTYPE);
     }
 
-  long long in_arm;
+  long long id;
   double reward;
 
-  if ((RedisModule_StringToLongLong(argv[2], &in_arm) != REDISMODULE_OK)) {
+  if ((RedisModule_StringToLongLong(argv[2], &id) != REDISMODULE_OK)) {
     return RedisModule_ReplyWithError(ctx,"ERR invalid value: must be a signed 64 bit integer");
   }
 
@@ -142,136 +2439,328 @@ int BanditUCBAdd_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int
 
   BanditUCBObject *hto = RedisModule_ModuleTypeGetValue(key);
 
-  if (in_arm < 0 || in_arm >= hto->narms) {
-    return RedisModule_ReplyWithError(ctx, "ERR invalid arm");
-  }
-
-  const ARM arm = in_arm;
-
-  const COUNT updated_count = hto->counts[arm] + 1;
-  (hto->counts[arm])++;
-  double updated_mean;
-  if (updated_count == 1) {
-    updated_mean = reward;
-  } else {
-    const double old_mean = hto->means[arm];
-    updated_mean = old_mean + (reward - old_mean) / updated_count;
+  Ticket *ticket = id > 0 ? ticketFind(hto, id, RedisModule_Milliseconds()) : NULL;
+  if (ticket == NULL) {
+    return RedisModule_ReplyWithError(ctx, "ERR unknown or expired ticket");
   }
+  const ARM arm = ticket->arm;
+  ticket->id = 0;
 
-  hto->means[arm] = updated_count;
-  hto->means[arm] = updated_mean;
+  hto = addRewards(key, hto, arm, 1, reward);
 
   RedisModule_SignalKeyAsReady(ctx,argv[1]);
 
   RedisModule_ReplyWithArray(ctx, 2);
-  RedisModule_ReplyWithLongLong(ctx, hto->counts[arm]);
-  RedisModule_ReplyWithDouble(ctx, hto->means[arm]);
+  RedisModule_ReplyWithLongLong(ctx, armCount(hto, arm));
+  RedisModule_ReplyWithDouble(ctx, armMean(hto, arm));
 
-  RedisModule_ReplicateVerbatim(ctx);
+  RedisModule_Replicate(ctx, "BANDITUCB.ADD", "sls", argv[1], (long long)arm, argv[3]);
   return REDISMODULE_OK;
 }
 
 
-/* BANDITUCB.SET <key> <arm> <count> <mean>
- * Reply with count and mean */
-int BanditUCBSet_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
-  RedisModule_AutoMemory(ctx); /* Use automatic memory management. */
+/* Prefetch the parts of o that pickArm reads first, the header must be in
+ * cache already. Small bandits are served from the header when their bounds
+ * are fresh, otherwise they read counts and means */
+static inline void prefetchBanditUCBObject(const BanditUCBObject *o) {
+    if (o->encoding == ENC_SPARSE) {
+      __builtin_prefetch(o->map);
+    } else if (o->encoding == ENC_COMPACT) {
+      __builtin_prefetch(compactCounts(o));
+    } else if (isSmallBandit(o)) {
+      if (o->dirty != 0) {
+	__builtin_prefetch(o->counts);
+	__builtin_prefetch(o->means);
+      }
+    } else {
+      __builtin_prefetch(o->tree);
+      __builtin_prefetch(&o->tree->nodes[1]);
+    }
+}
 
-  if (argc != 5) return RedisModule_WrongArity(ctx);
 
-  RedisModuleKey *key = RedisModule_OpenKey(ctx,argv[1],
-					    REDISMODULE_READ|REDISMODULE_WRITE);
-  int type = RedisModule_KeyType(key);
-  if (type != REDISMODULE_KEYTYPE_EMPTY &&
-      RedisModule_ModuleTypeGetType(key) != BanditUCBType)
-    {
-      return RedisModule_ReplyWithError(ctx,REDISMODULE_ERRORMSG_WRONGTYPE);
+/* BANDITUCB.MPICK <key> [<key> ...]
+ * Reply with an arm picked from each key, as PICK would, nil for missing keys.
+ * Objects are looked up first, then picked from in order while the header
+ * of the object two ahead and the arrays of the next one are prefetched */
+int BanditUCBMPick_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    if (argc < 2) return RedisModule_WrongArity(ctx);
+
+    const int nkeys = argc - 1;
+    BanditUCBObject **objs = RedisModule_PoolAlloc(ctx, nkeys * sizeof(BanditUCBObject*));
+    for (int i = 0; i < nkeys; ++i) {
+      RedisModuleKey *key = RedisModule_OpenKey(ctx, argv[1 + i], REDISMODULE_READ);
+      const int type = RedisModule_KeyType(key);
+      if (type != REDISMODULE_KEYTYPE_EMPTY &&
+	  RedisModule_ModuleTypeGetType(key) != BanditUCBType) {
+	RedisModule_CloseKey(key);
+	return RedisModule_ReplyWithError(ctx,REDISMODULE_ERRORMSG_WRONGTYPE);
+      }
+      objs[i] = type == REDISMODULE_KEYTYPE_EMPTY ? NULL : RedisModule_ModuleTypeGetValue(key);
+      RedisModule_CloseKey(key);
     }
 
-  long long arm;
-  long long count;
-  double mean;
+    if (objs[0] != NULL) {
+      __builtin_prefetch(objs[0]);
+    }
+    if (nkeys > 1 && objs[1] != NULL) {
+      __builtin_prefetch(objs[1]);
+    }
+    if (objs[0] != NULL) {
+      prefetchBanditUCBObject(objs[0]);
+    }
 
-  if ((RedisModule_StringToLongLong(argv[2], &arm) != REDISMODULE_OK)) {
-    return RedisModule_ReplyWithError(ctx,"ERR invalid value: arm must be an unsigned 64 bit integer");
-  }
+    RedisModule_ReplyWithArray(ctx, nkeys);
+    for (int i = 0; i < nkeys; ++i) {
+      if (i + 2 < nkeys && objs[i + 2] != NULL) {
+	__builtin_prefetch(objs[i + 2]);
+      }
+      if (i + 1 < nkeys && objs[i + 1] != NULL) {
+	prefetchBanditUCBObject(objs[i + 1]);
+      }
 
-  if ((RedisModule_StringToLongLong(argv[3] ,&count) != REDISMODULE_OK)) {
-    return RedisModule_ReplyWithError(ctx,"ERR invalid value: count must be an unsigned 64 bit integer");
-  }
+      ARM arm;
+      if (objs[i] == NULL) {
+	RedisModule_ReplyWithNull(ctx);
+      } else if (!pickArmPending(objs[i], &arm)) {
+	RedisModule_ReplyWithError(ctx,"no choices");
+      } else {
+	RedisModule_ReplyWithLongLong(ctx, arm);
+      }
+    }
 
-  if ((RedisModule_StringToDouble(argv[4], &mean) != REDISMODULE_OK)) {
-    return RedisModule_ReplyWithError(ctx,"ERR invalid value: total must be a double");
-  }
+    return REDISMODULE_OK;
+}
 
-  if (type == REDISMODULE_KEYTYPE_EMPTY) {
-    return RedisModule_ReplyWithError(ctx, "ERR bandit needs to be initialized first");
-  }
 
-  BanditUCBObject *hto = RedisModule_ModuleTypeGetValue(key);
+/* A pulled arm competing for PICKN. tie is random, it orders equal bounds */
+struct RankedArm {
+  double bound;
+  ARM arm;
+  uint32_t tie;
+};
+typedef struct RankedArm RankedArm;
 
-  if (arm < 0 || arm >= hto->narms) {
-    return RedisModule_ReplyWithError(ctx, "ERR invalid arm");
-  }
 
-  hto->counts[arm] = count;
-  hto->means[arm] = mean;
+static inline bool rankedBelow(const RankedArm *a, const RankedArm *b) {
+    return a->bound < b->bound || (a->bound == b->bound && a->tie < b->tie);
+}
 
-  RedisModule_SignalKeyAsReady(ctx, argv[1]);
-  
-  RedisModule_ReplyWithArray(ctx, 2);
-  RedisModule_ReplyWithLongLong(ctx, hto->counts[arm]);
-  RedisModule_ReplyWithDouble(ctx, hto->means[arm]);
 
-  RedisModule_ReplicateVerbatim(ctx);
-  return REDISMODULE_OK;
+/* Sift the entry at i of the min heap down */
+static void rankedSiftDown(RankedArm *heap, ARM n, ARM i) {
+    for (;;) {
+      ARM least = i;
+      const ARM l = 2 * i + 1, r = 2 * i + 2;
+      if (l < n && rankedBelow(&heap[l], &heap[least])) least = l;
+      if (r < n && rankedBelow(&heap[r], &heap[least])) least = r;
+      if (least == i) {
+	return;
+      }
+      const RankedArm t = heap[i];
+      heap[i] = heap[least];
+      heap[least] = t;
+      i = least;
+    }
+}
+
+
+/* Choose the k best arms, best first, into arms.
+ * Unpulled arms come first, a random sample of them in random order, then
+ * pulled arms by decreasing bound with ties in random order. Arms with a NaN
+ * bound are never chosen, so fewer than k arms can be returned.
+ * One pass over the arms: unpulled ones are reservoir sampled and pulled ones
+ * kept in a min heap of the k best, so it only needs room for 2k arms.
+ * Returns the number of arms chosen */
+ARM pickArms(BanditUCBObject *hto, RandState *rng, ARM k, ARM *arms, RankedArm *heap) {
+    const double *bounds = NULL;
+    if (isSmallBandit(hto) && hto->encoding == ENC_WIDE) {
+      refreshBounds(hto);
+      bounds = hto->bounds;
+    }
+
+    ARM nunpulled = 0, nheap = 0;
+    for (ARM i = 0; i < hto->narms; ++i) {
+      if (armPulls(hto, i) == 0) {
+	if (nunpulled < k) {
+	  arms[nunpulled] = i;
+	} else {
+	  const ARM j = randInt(rng, nunpulled + 1);
+	  if (j < k) {
+	    arms[j] = i;
+	  }
+	}
+	++nunpulled;
+	continue;
+      }
+      if (nunpulled >= k) {
+	continue;
+      }
+      const RankedArm e = {bounds ? bounds[i] : armBound(hto, i), i, (uint32_t)(randNext(rng) >> 32)};
+      if (isnan(e.bound)) {
+	continue;
+      }
+      if (nheap < k) {
+	heap[nheap++] = e;
+	if (nheap == k) {
+	  for (ARM j = k / 2; j-- > 0; ) {
+	    rankedSiftDown(heap, nheap, j);
+	  }
+	}
+      } else if (rankedBelow(&heap[0], &e)) {
+	heap[0] = e;
+	rankedSiftDown(heap, nheap, 0);
+      }
+    }
+
+    const ARM nsample = nunpulled < k ? nunpulled : k;
+    for (ARM i = 0; i + 1 < nsample; ++i) {
+      const ARM j = i + randInt(rng, nsample - i);
+      const ARM t = arms[i];
+      arms[i] = arms[j];
+      arms[j] = t;
+    }
+    if (nsample == k) {
+      return k;
+    }
+
+    // the heap holds the best of all pulled arms, pop what is needed worst first
+    if (nheap < k) {
+      for (ARM j = nheap / 2; j-- > 0; ) {
+	rankedSiftDown(heap, nheap, j);
+      }
+    }
+    const ARM npulled = nheap < k - nsample ? nheap : k - nsample;
+    while (nheap > npulled) {
+      heap[0] = heap[--nheap];
+      rankedSiftDown(heap, nheap, 0);
+    }
+    while (nheap > 0) {
+      arms[nsample + nheap - 1] = heap[0].arm;
+      heap[0] = heap[--nheap];
+      rankedSiftDown(heap, nheap, 0);
+    }
+    return nsample + npulled;
+}
+
+
+/* Largest batch for PICKBATCH */
+#define PICKBATCH_MAX (1 << 20)
+
+
+/* Heap key of arm in a batch where it has count pulls, its bound negated */
+static inline double batchKey(const BanditUCBObject *hto, double logt, ARM arm, COUNT count) {
+    const double bound = armMean(hto, arm) + exploreTerm(hto->c, logt, count);
+    return isnan(bound) ? INFINITY : -bound;
 }
 
 
-/* draw from [0,n( evenly distributed by rejecting some of the range */
-int randInt(int n) {  
-  long limit = (RAND_MAX / n)*n;  
-  int r;  
-  while (true){ 
-    r = rand(); 
-    if(r < limit)
-      break; 
-  } 
-  return r % n;  
-} 
+/* BANDITUCB.PICKBATCH <key> <n>
+ * Reply with n arms to pull, each picked as PICK would after counting the
+ * previous ones as pulls without reward, so a batch spreads over arms
+ * instead of returning the same one n times. log(t) stays the one before the
+ * batch, then only the bound of the arm picked changes at each step.
+ * The arms picked first are unpulled ones, then an arm can only be picked if
+ * its bound was among the n - nunpulled best ones (at least as many better
+ * arms would be picked before it), so pickArms gives every candidate and
+ * the batch is served from a heap of them. The bandit is left unchanged,
+ * except that with banditucb.pending-ttl the picks become pending pulls */
+int BanditUCBPickBatch_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    RedisModule_AutoMemory(ctx); /* Use automatic memory management. */
+
+    if (argc != 3) return RedisModule_WrongArity(ctx);
+    RedisModuleKey *key = RedisModule_OpenKey(ctx,argv[1],
+        REDISMODULE_READ|REDISMODULE_WRITE);
+    int type = RedisModule_KeyType(key);
+    if (type != REDISMODULE_KEYTYPE_EMPTY &&
+        RedisModule_ModuleTypeGetType(key) != BanditUCBType)
+    {
+        return RedisModule_ReplyWithError(ctx,REDISMODULE_ERRORMSG_WRONGTYPE);
+    }
+
+    long long n;
+    if ((RedisModule_StringToLongLong(argv[2], &n) != REDISMODULE_OK)) {
+      return RedisModule_ReplyWithError(ctx,"ERR invalid value: n must be a signed 64 bit integer");
+    }
+    if (n <= 0 || n > PICKBATCH_MAX) {
+      return RedisModule_ReplyWithError(ctx,"ERR invalid value: n must be > 0 and <= 1048576");
+    }
+
+    if (type == REDISMODULE_KEYTYPE_EMPTY) {
+          return RedisModule_ReplyWithError(ctx, "ERR bandit needs to be initialized first");
+    }
+
+    struct BanditUCBObject *hto = RedisModule_ModuleTypeGetValue(key);
+    const ARM k = n < hto->narms ? n : hto->narms;
+
+    ARM *arms = RedisModule_PoolAlloc(ctx, k * sizeof(ARM));
+    RankedArm *heap = RedisModule_PoolAlloc(ctx, k * sizeof(RankedArm));
+    const mstime_t now = RedisModule_Milliseconds();
+    expirePendingPulls(hto, now);
+    const ARM ncandidates = pickArms(hto, &moduleRng, k, arms, heap);
+    if (ncandidates == 0) {
+      return RedisModule_ReplyWithError(ctx,"no choices");
+    }
 
+    RedisModule_ReplyWithArray(ctx, n);
+    long long replied = 0;
+    ARM nunpulled = 0;
+    while (nunpulled < ncandidates && armPulls(hto, arms[nunpulled]) == 0) {
+      if (replied < n) {
+	RedisModule_ReplyWithLongLong(ctx, arms[nunpulled]);
+	++replied;
+      }
+      ++nunpulled;
+    }
+    if (replied == n) {
+      for (ARM i = 0; i < n; ++i) {
+	pendingPicks(hto, arms[i], 1, now);
+      }
+      return REDISMODULE_OK;
+    }
 
-/* sum counts */
-COUNT sumcounts(const COUNT *counts, uint64_t n) {
-  uint64_t t = 0;
-  for (ARM i = 0; i < n; ++i) {
-    t += counts[i];
-  }
-  return t;
-}
+    // the heap of pickArms keeps the worst on top, here bounds are negated
+    // so the best is, NaN last. arm is the index of the candidate.
+    // Without any pull log(t) is -inf and all bounds NaN, every arm is a
+    // candidate then (n > narms) and log(t) after the unpulled ones is used.
+    // Pending pulls before the first reward have a log(t) of their own
+    const double logt = hto->total != 0 || pendingOf(hto) != NULL ? hto->logt : log(nunpulled);
+    COUNT *counts = RedisModule_PoolAlloc(ctx, ncandidates * sizeof(COUNT));
+    for (ARM i = 0; i < ncandidates; ++i) {
+      counts[i] = armPulls(hto, arms[i]) + (i < nunpulled);
+      heap[i].bound = batchKey(hto, logt, arms[i], counts[i]);
+      heap[i].arm = i;
+      heap[i].tie = randNext(&moduleRng) >> 32;
+    }
+    for (ARM j = ncandidates / 2; j-- > 0; ) {
+      rankedSiftDown(heap, ncandidates, j);
+    }
+    for (; replied < n; ++replied) {
+      const ARM i = heap[0].arm;
+      RedisModule_ReplyWithLongLong(ctx, arms[i]);
+      ++counts[i];
+      heap[0].bound = batchKey(hto, logt, arms[i], counts[i]);
+      heap[0].tie = randNext(&moduleRng) >> 32;
+      rankedSiftDown(heap, ncandidates, 0);
+    }
 
+    // counts went up by the picks of each candidate, unpulled ones included
+    for (ARM i = 0; i < ncandidates; ++i) {
+      pendingPicks(hto, arms[i], counts[i] - armPulls(hto, arms[i]), now);
+    }
 
-/* compute UCB bounds for all arms */
-void computeBounds(BanditUCBObject *hto,
-		   double* bounds) {
-  const double t = sumcounts(hto->counts, hto->narms);
-  const double logt = log(t);
-  for(ARM i=0; i < hto->narms; ++i) {
-    const double z = hto->c * sqrt(logt / hto->counts[i]);
-    const double mean = hto->means[i];
-    const double bound = mean + z;
-    bounds[i] = bound;
-  }
+    return REDISMODULE_OK;
 }
 
 
-/* BANDITUCB.PICK <key>
- * Reply with the picked arm.
- * pick is non-deterministic (breaking ties) but that's OK as it doesn't change any state */
-int BanditUCBPick_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+/* BANDITUCB.PICKN <key> <k> [WITHSCORES]
+ * Reply with the k best arms, best first, see pickArms.
+ * With WITHSCORES each arm is followed by its bound, from before the arms
+ * become pending pulls with banditucb.pending-ttl */
+int BanditUCBPickN_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
     RedisModule_AutoMemory(ctx); /* Use automatic memory management. */
 
-    if (argc != 2) return RedisModule_WrongArity(ctx);
+    if (argc != 3 && argc != 4) return RedisModule_WrongArity(ctx);
     RedisModuleKey *key = RedisModule_OpenKey(ctx,argv[1],
         REDISMODULE_READ|REDISMODULE_WRITE);
     int type = RedisModule_KeyType(key);
@@ -281,71 +2770,74 @@ int BanditUCBPick_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, in
         return RedisModule_ReplyWithError(ctx,REDISMODULE_ERRORMSG_WRONGTYPE);
     }
 
-    struct BanditUCBObject *hto = RedisModule_ModuleTypeGetValue(key);
-
-    // single-threaded so OK
-    static int choices[MAX_ARMS];
-    static double bounds[MAX_ARMS];
-    int* pchoices = choices;
-
-    // if there are still unpulled arms pull one choose between them
-
-    for(ARM i=0; i < hto->narms; ++i) {
-      if (hto->counts[i] == 0) {
-	*pchoices++ = i;
-      }
+    long long k;
+    if ((RedisModule_StringToLongLong(argv[2], &k) != REDISMODULE_OK)) {
+      return RedisModule_ReplyWithError(ctx,"ERR invalid value: k must be a signed 64 bit integer");
+    }
+    if (k <= 0) {
+      return RedisModule_ReplyWithError(ctx,"ERR invalid value: k must be > 0");
     }
 
-    int nchoices = pchoices - choices;
-    if (nchoices == 0) {
-      // all pulled at least once, compare UCB bounds
-
-      computeBounds(hto, bounds);
-
-      double bestBound = -INFINITY;
-      for(ARM i=0; i < hto->narms; ++i) {
-	if (bounds[i] > bestBound) {
-	  bestBound = bounds[i];
-	}
-      }
+    const bool withscores = argc == 4;
+    if (withscores && !isOption(argv[3], "WITHSCORES")) {
+      return RedisModule_ReplyWithError(ctx,"ERR syntax error");
+    }
 
-      // it's floating point but ties are not necessarily zero probability
-      // so consider all
-      for (ARM i=0; i < hto->narms; ++i) {
-	if (bounds[i] == bestBound) {
-	  *pchoices++ = i;
-	}
-      }
-      nchoices = pchoices - choices;
+    if (type == REDISMODULE_KEYTYPE_EMPTY) {
+          return RedisModule_ReplyWithError(ctx, "ERR bandit needs to be initialized first");
     }
 
-    if (nchoices == 0) {
-      return RedisModule_ReplyWithError(ctx,"no choices");
+    struct BanditUCBObject *hto = RedisModule_ModuleTypeGetValue(key);
+    if (k > hto->narms) {
+      k = hto->narms;
     }
 
-    // pick from choices
-    int ichoice;
-    if (nchoices == 1) {
-      // only 1 option, no need to draw at random
-      ichoice = 0;
-    } else {
-      ichoice = randInt(nchoices);
+    ARM *arms = RedisModule_PoolAlloc(ctx, k * sizeof(ARM));
+    RankedArm *heap = RedisModule_PoolAlloc(ctx, k * sizeof(RankedArm));
+    const mstime_t now = RedisModule_Milliseconds();
+    expirePendingPulls(hto, now);
+    const ARM n = pickArms(hto, &moduleRng, k, arms, heap);
+
+    RedisModule_ReplyWithArray(ctx, withscores ? 2 * n : n);
+    for (ARM i = 0; i < n; ++i) {
+      RedisModule_ReplyWithLongLong(ctx, arms[i]);
+      if (withscores) {
+	// same bounds as BOUNDS, the cached ones when there are
+	RedisModule_ReplyWithDouble(ctx, isSmallBandit(hto) && hto->encoding == ENC_WIDE ?
+				    hto->bounds[arms[i]] : armBound(hto, arms[i]));
+      }
+    }
+    for (ARM i = 0; i < n; ++i) {
+      pendingPicks(hto, arms[i], 1, now);
     }
-    ARM arm = choices[ichoice];
 
-    RedisModule_ReplyWithLongLong(ctx, arm);
-    
     return REDISMODULE_OK;
 }
 
 
-/* BANDITUCB.COUNTS <key>
+/* Reply with n 64 bit values, uint64 or double, as one little-endian
+ * string. Little-endian hosts send values as they are */
+static void replyWithPacked(RedisModuleCtx *ctx, const void *values, ARM n) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    uint64_t *swapped = RedisModule_PoolAlloc(ctx, n * sizeof(uint64_t));
+    memcpy(swapped, values, n * sizeof(uint64_t));
+    for (ARM i = 0; i < n; ++i) {
+      swapped[i] = __builtin_bswap64(swapped[i]);
+    }
+    values = swapped;
+#endif
+    RedisModule_ReplyWithStringBuffer(ctx, values, n * sizeof(uint64_t));
+}
+
+
+/* BANDITUCB.COUNTS <key> [BINARY]
  * Reply with counts for all arms
+ * With BINARY as a string of little-endian uint64
  */
 int BanditUCBCounts_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
     RedisModule_AutoMemory(ctx); /* Use automatic memory management. */
 
-    if (argc != 2) return RedisModule_WrongArity(ctx);
+    if (argc != 2 && argc != 3) return RedisModule_WrongArity(ctx);
     RedisModuleKey *key = RedisModule_OpenKey(ctx,argv[1],
         REDISMODULE_READ|REDISMODULE_WRITE);
     int type = RedisModule_KeyType(key);
@@ -355,28 +2847,47 @@ int BanditUCBCounts_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv,
         return RedisModule_ReplyWithError(ctx,REDISMODULE_ERRORMSG_WRONGTYPE);
     }
 
+    const bool binary = argc == 3;
+    if (binary && !isOption(argv[2], "BINARY")) {
+      return RedisModule_ReplyWithError(ctx,"ERR syntax error");
+    }
+
     BanditUCBObject *hto = RedisModule_ModuleTypeGetValue(key);
 
     if (type == REDISMODULE_KEYTYPE_EMPTY) {
           return RedisModule_ReplyWithError(ctx, "ERR bandit needs to be initialized first");
     }
 
+    if (binary) {
+      if (hto->encoding == ENC_WIDE) {
+	replyWithPacked(ctx, hto->counts, hto->narms);
+	return REDISMODULE_OK;
+      }
+      uint64_t *counts = RedisModule_PoolAlloc(ctx, hto->narms * sizeof(uint64_t));
+      for (ARM i = 0; i < hto->narms; ++i) {
+	counts[i] = armCount(hto, i);
+      }
+      replyWithPacked(ctx, counts, hto->narms);
+      return REDISMODULE_OK;
+    }
+
     RedisModule_ReplyWithArray(ctx,hto->narms);
     for (ARM i = 0; i < hto->narms; ++i) {
-        RedisModule_ReplyWithLongLong(ctx, hto->counts[i]);
+        RedisModule_ReplyWithLongLong(ctx, armCount(hto, i));
     }
 
     return REDISMODULE_OK;
 }
 
 
-/* BANDITUCB.MEANS <key>
+/* BANDITUCB.MEANS <key> [BINARY]
  * Reply with means for all arms
+ * With BINARY as a string of little-endian float64
  */
 int BanditUCBMeans_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
     RedisModule_AutoMemory(ctx); /* Use automatic memory management. */
 
-    if (argc != 2) return RedisModule_WrongArity(ctx);
+    if (argc != 2 && argc != 3) return RedisModule_WrongArity(ctx);
     RedisModuleKey *key = RedisModule_OpenKey(ctx,argv[1],
         REDISMODULE_READ|REDISMODULE_WRITE);
     int type = RedisModule_KeyType(key);
@@ -386,28 +2897,81 @@ int BanditUCBMeans_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, i
         return RedisModule_ReplyWithError(ctx,REDISMODULE_ERRORMSG_WRONGTYPE);
     }
 
+    const bool binary = argc == 3;
+    if (binary && !isOption(argv[2], "BINARY")) {
+      return RedisModule_ReplyWithError(ctx,"ERR syntax error");
+    }
+
     struct BanditUCBObject *hto = RedisModule_ModuleTypeGetValue(key);
 
     if (type == REDISMODULE_KEYTYPE_EMPTY) {
           return RedisModule_ReplyWithError(ctx, "ERR bandit needs to be initialized first");
     }
 
+    if (binary) {
+      if (hto->encoding == ENC_WIDE) {
+	replyWithPacked(ctx, hto->means, hto->narms);
+	return REDISMODULE_OK;
+      }
+      double *means = RedisModule_PoolAlloc(ctx, hto->narms * sizeof(double));
+      for (ARM i = 0; i < hto->narms; ++i) {
+	means[i] = armMean(hto, i);
+      }
+      replyWithPacked(ctx, means, hto->narms);
+      return REDISMODULE_OK;
+    }
+
     RedisModule_ReplyWithArray(ctx,hto->narms);
     for (ARM i = 0; i < hto->narms; ++i) {
-        RedisModule_ReplyWithDouble(ctx, hto->means[i]);
+        RedisModule_ReplyWithDouble(ctx, armMean(hto, i));
     }
 
     return REDISMODULE_OK;
 }
 
 
-/* BANDITUCB.BOUNDS <key>
+/* Reply with the bounds of all arms, the cached ones when there are.
+ * Packed with binary */
+static void replyWithBounds(RedisModuleCtx *ctx, BanditUCBObject *hto, bool binary) {
+    if (!isSmallBandit(hto) || hto->encoding == ENC_COMPACT) {
+      // exact bounds, not the tree values, compact and sparse bandits have no
+      // bounds kept
+      if (binary) {
+	double *bounds = RedisModule_PoolAlloc(ctx, hto->narms * sizeof(double));
+	for (ARM i = 0; i < hto->narms; ++i) {
+	  bounds[i] = armBound(hto, i);
+	}
+	replyWithPacked(ctx, bounds, hto->narms);
+	return;
+      }
+      RedisModule_ReplyWithArray(ctx,hto->narms);
+      for (ARM i = 0; i < hto->narms; ++i) {
+	RedisModule_ReplyWithDouble(ctx, armBound(hto, i));
+      }
+      return;
+    }
+
+    refreshBounds(hto);
+
+    if (binary) {
+      replyWithPacked(ctx, hto->bounds, hto->narms);
+      return;
+    }
+    RedisModule_ReplyWithArray(ctx,hto->narms);
+    for (ARM i = 0; i < hto->narms; ++i) {
+      RedisModule_ReplyWithDouble(ctx, hto->bounds[i]);
+    }
+}
+
+
+/* BANDITUCB.BOUNDS <key> [BINARY]
  * Reply with UCB bounds for all arms
+ * With BINARY as a string of little-endian float64
  */
 int BanditUCBBounds_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
     RedisModule_AutoMemory(ctx); /* Use automatic memory management. */
 
-    if (argc != 2) return RedisModule_WrongArity(ctx);
+    if (argc != 2 && argc != 3) return RedisModule_WrongArity(ctx);
     RedisModuleKey *key = RedisModule_OpenKey(ctx,argv[1],
 					      REDISMODULE_READ|REDISMODULE_WRITE);
     int type = RedisModule_KeyType(key);
@@ -415,38 +2979,156 @@ int BanditUCBBounds_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv,
         RedisModule_ModuleTypeGetType(key) != BanditUCBType) {
       return RedisModule_ReplyWithError(ctx,REDISMODULE_ERRORMSG_WRONGTYPE);
     }
+
+    const bool binary = argc == 3;
+    if (binary && !isOption(argv[2], "BINARY")) {
+      return RedisModule_ReplyWithError(ctx,"ERR syntax error");
+    }
     
+    if (type == REDISMODULE_KEYTYPE_EMPTY) {
+          return RedisModule_ReplyWithError(ctx, "ERR bandit needs to be initialized first");
+    }
+
     BanditUCBObject *hto = RedisModule_ModuleTypeGetValue(key);
 
-    // single-threaded so OK
-    static double bounds[MAX_ARMS];
-    computeBounds(hto, bounds);
+    replyWithBounds(ctx, hto, binary);
+    return REDISMODULE_OK;
+}
+
+
+/* BANDITUCB.STATE <key>
+ * Reply with a map of c, narms, total and the counts, means and bounds of
+ * all arms, from the same state in one round trip. A flat array of keys and
+ * values with RESP2 or servers without maps */
+int BanditUCBState_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    RedisModule_AutoMemory(ctx); /* Use automatic memory management. */
+
+    if (argc != 2) return RedisModule_WrongArity(ctx);
+    RedisModuleKey *key = RedisModule_OpenKey(ctx,argv[1],
+					      REDISMODULE_READ|REDISMODULE_WRITE);
+    int type = RedisModule_KeyType(key);
+    if (type != REDISMODULE_KEYTYPE_EMPTY &&
+        RedisModule_ModuleTypeGetType(key) != BanditUCBType) {
+      return RedisModule_ReplyWithError(ctx,REDISMODULE_ERRORMSG_WRONGTYPE);
+    }
     
-    RedisModule_ReplyWithArray(ctx,hto->narms);
+    if (type == REDISMODULE_KEYTYPE_EMPTY) {
+          return RedisModule_ReplyWithError(ctx, "ERR bandit needs to be initialized first");
+    }
+
+    BanditUCBObject *hto = RedisModule_ModuleTypeGetValue(key);
 
+    // maps came with Redis 7, older servers get the flat array RESP2 would
+    if (RedisModule_ReplyWithMap != NULL) {
+      RedisModule_ReplyWithMap(ctx, 6);
+    } else {
+      RedisModule_ReplyWithArray(ctx, 12);
+    }
+    RedisModule_ReplyWithCString(ctx, "c");
+    RedisModule_ReplyWithDouble(ctx, hto->c);
+    RedisModule_ReplyWithCString(ctx, "narms");
+    RedisModule_ReplyWithLongLong(ctx, hto->narms);
+    RedisModule_ReplyWithCString(ctx, "total");
+    RedisModule_ReplyWithLongLong(ctx, hto->total);
+    RedisModule_ReplyWithCString(ctx, "counts");
+    RedisModule_ReplyWithArray(ctx, hto->narms);
+    for (ARM i = 0; i < hto->narms; ++i) {
+      RedisModule_ReplyWithLongLong(ctx, armCount(hto, i));
+    }
+    RedisModule_ReplyWithCString(ctx, "means");
+    RedisModule_ReplyWithArray(ctx, hto->narms);
     for (ARM i = 0; i < hto->narms; ++i) {
-      RedisModule_ReplyWithDouble(ctx, bounds[i]);
+      RedisModule_ReplyWithDouble(ctx, armMean(hto, i));
     }
+    RedisModule_ReplyWithCString(ctx, "bounds");
+    replyWithBounds(ctx, hto, false);
 
     return REDISMODULE_OK;
 }
 
 
+/* RDB encoding version. 1 added the arm encoding after c,
+ * compact bandits save their means as floats.
+ * 2 added sparse bandits, saved as the number of arms in their map then
+ * arm, count and mean for each */
+#define BANDITUCB_ENCVER 2
+
+
 /* Load BanditUCBObject from RDB */
 void *BanditUCBRdbLoad(RedisModuleIO *rdb, int encver) {
 
-    if (encver != 0) {
+    if (encver > BANDITUCB_ENCVER) {
         return NULL;
     }
 
     ARM narms = RedisModule_LoadUnsigned(rdb);
+    if (narms == 0 || narms > MAX_ARMS) {
+        return NULL;
+    }
     double c = RedisModule_LoadDouble(rdb);
-    BanditUCBObject *hto = createBanditUCBObject(narms, c);
-    for(ARM i=0; i < hto->narms; ++i) {
-      hto->counts[i] = RedisModule_LoadUnsigned(rdb);
+    int encoding = ENC_WIDE;
+    if (encver >= 1) {
+      encoding = RedisModule_LoadUnsigned(rdb);
+      if (encoding != ENC_WIDE &&
+	  (encoding != ENC_COMPACT || narms > SMALL_ARMS) &&
+	  (encoding != ENC_SPARSE || narms <= SMALL_ARMS || encver < 2)) {
+        return NULL;
+      }
+    }
+
+    if (encoding == ENC_SPARSE) {
+      const uint64_t size = RedisModule_LoadUnsigned(rdb);
+      if (2 * size >= narms) {
+	return NULL;
+      }
+      BanditUCBObject *hto = createBanditUCBObject(narms, c, encoding);
+      for (uint64_t j = 0; j < size; ++j) {
+	const uint64_t arm = RedisModule_LoadUnsigned(rdb);
+	const COUNT count = RedisModule_LoadUnsigned(rdb);
+	const double mean = RedisModule_LoadDouble(rdb);
+	if (arm >= narms) {
+	  BanditUCBReleaseObject(hto);
+	  return NULL;
+	}
+	setArm(hto, arm, count, mean);
+      }
+      return hto;
+    }
+
+    /* a single allocation, counts and means are filled in place */
+    BanditUCBObject *hto = createBanditUCBObject(narms, c, encoding);
+    COUNT total = 0;
+    if (encoding == ENC_COMPACT) {
+      for(ARM i=0; i < hto->narms; ++i) {
+	const uint64_t count = RedisModule_LoadUnsigned(rdb);
+	if (count > COMPACT_MAX_COUNT) {
+	  BanditUCBReleaseObject(hto);
+	  return NULL;
+	}
+	compactCounts(hto)[i] = count;
+	total += count;
+      }
+      for(ARM i=0; i < hto->narms; ++i) {
+	compactMeans(hto)[i] = RedisModule_LoadFloat(rdb);
+      }
+    } else {
+      for(ARM i=0; i < hto->narms; ++i) {
+	hto->counts[i] = RedisModule_LoadUnsigned(rdb);
+      }
+      for(ARM i=0; i < hto->narms; ++i) {
+	hto->means[i] = RedisModule_LoadDouble(rdb);
+      }
+      total = sumcounts(hto->counts, hto->narms);
     }
-    for(ARM i=0; i < hto->narms; ++i) {
-      hto->means[i] = RedisModule_LoadDouble(rdb);
+    setTotalCount(hto, total);
+    if (isSmallBandit(hto)) {
+      hto->unpulled = 0;
+      for(ARM i=0; i < hto->narms; ++i) {
+	armUpdated(hto, i);
+      }
+    } else {
+      treeRebuild(hto);
+      treeRebuildUnpulled(hto);
     }
     
     return hto;
@@ -459,23 +3141,59 @@ void BanditUCBRdbSave(RedisModuleIO *rdb, void *value) {
     BanditUCBObject *hto = value;
     RedisModule_SaveUnsigned(rdb, hto->narms);
     RedisModule_SaveDouble(rdb, hto->c);
+    RedisModule_SaveUnsigned(rdb, hto->encoding);
+    if (hto->encoding == ENC_SPARSE) {
+      const SparseMap *map = hto->map;
+      RedisModule_SaveUnsigned(rdb, map->size);
+      for (ARM j = 0; j < map->capacity; ++j) {
+	if (map->arms[j] != SPARSE_EMPTY) {
+	  RedisModule_SaveUnsigned(rdb, map->arms[j]);
+	  RedisModule_SaveUnsigned(rdb, map->counts[j]);
+	  RedisModule_SaveDouble(rdb, map->means[j]);
+	}
+      }
+      return;
+    }
     for (ARM i = 0; i < hto->narms; ++i) {
-      RedisModule_SaveUnsigned(rdb, hto->counts[i]);
+      RedisModule_SaveUnsigned(rdb, armCount(hto, i));
     }
     for (ARM i = 0; i < hto->narms; ++i) {
-      RedisModule_SaveDouble(rdb, hto->means[i]);
+      if (hto->encoding == ENC_COMPACT) {
+	RedisModule_SaveFloat(rdb, compactMeans(hto)[i]);
+      } else {
+	RedisModule_SaveDouble(rdb, hto->means[i]);
+      }
     }
 }
 
 
 /* Rewrite BanditUCB object in AOF
- * As a single BANDITUCB.SET command for each arm */
+ * As a single BANDITUCB.SET command for each arm.
+ * Float means of compact bandits are exact as doubles, replaying gives
+ * back the same values whatever encoding the new key gets */
 void BanditUCBAofRewrite(RedisModuleIO *aof, RedisModuleString *key, void *value) {
 
   BanditUCBObject *hto = value;
-  RedisModule_EmitAOF(aof, "BANDITUCB.INIT", "sld", key, hto->narms, hto->c);
+  RedisModule_EmitAOF(aof, "BANDITUCB.INIT", "sld", key, (long long)hto->narms, hto->c);
+  if (hto->encoding == ENC_SPARSE) {
+    const SparseMap *map = hto->map;
+    for (ARM j = 0; j < map->capacity; ++j) {
+      if (map->arms[j] != SPARSE_EMPTY) {
+	RedisModule_EmitAOF(aof, "BANDITUCB.SET", "slld", key, (long long)map->arms[j],
+			    (long long)map->counts[j], map->means[j]);
+      }
+    }
+    return;
+  }
   for(ARM i = 0; i < hto->narms; ++i) {
-    RedisModule_EmitAOF(aof, "BANDITUCB.SET", "slld", key, i, hto->counts[i], hto->means[i]);
+    // INIT zeroes arms, large catalogs have many untouched ones
+    const COUNT count = armCount(hto, i);
+    const double mean = armMean(hto, i);
+    if (count == 0 && mean == 0.0) {
+      continue;
+    }
+    RedisModule_EmitAOF(aof, "BANDITUCB.SET", "slld", key, (long long)i,
+			(long long)count, mean);
   }
 }
 
@@ -483,7 +3201,17 @@ void BanditUCBAofRewrite(RedisModuleIO *aof, RedisModuleString *key, void *value
 /* Compute memory usage */
 size_t BanditUCBMemUsage(const void *value) {
     const BanditUCBObject *hto = value;
-    return hto->narms * (sizeof(COUNT) + sizeof(double)) + sizeof(*hto);
+    size_t size = banditUCBObjectSize(hto->narms, hto->encoding);
+    if (hto->encoding == ENC_SPARSE) {
+      size += sparseMapSize(hto->map->capacity);
+    }
+    if (hto->picks != NULL) {
+      size += sizeof(PickState) + pendingPullsSize(hto->picks->pending);
+      if (hto->picks->tickets != NULL) {
+	size += sizeof(TicketRing) + hto->picks->tickets->capacity * sizeof(Ticket);
+      }
+    }
+    return size;
 }
 
 
@@ -499,16 +3227,205 @@ void BanditUCBDigest(RedisModuleDigest *md, void *value) {
     BanditUCBObject *hto = value;
     RedisModule_DigestAddLongLong(md,hto->narms);
     for(ARM i = 0; i < hto->narms; ++i) {
-        RedisModule_DigestAddLongLong(md, hto->counts[i]);
+        RedisModule_DigestAddLongLong(md, armCount(hto, i));
     }
     for(ARM i = 0; i < hto->narms; ++i) {
       // there is no DigestAddDouble. casting to long long, fine for digest
-      RedisModule_DigestAddLongLong(md, (long long)hto->means[i]);
+      RedisModule_DigestAddLongLong(md, (long long)armMean(hto, i));
     }
     RedisModule_DigestEndSequence(md);
 }
 
 
+/* banditucb.seed config */
+long long getSeedConfig(const char *name, void *privdata) {
+    REDISMODULE_NOT_USED(name);
+    REDISMODULE_NOT_USED(privdata);
+    return rngSeed;
+}
+
+
+int setSeedConfig(const char *name, long long val, void *privdata, RedisModuleString **err) {
+    REDISMODULE_NOT_USED(name);
+    REDISMODULE_NOT_USED(privdata);
+    REDISMODULE_NOT_USED(err);
+    rngSeed = val;
+    return REDISMODULE_OK;
+}
+
+
+/* (re)seeding on apply, so setting the same seed again restarts the sequence */
+int applySeedConfig(RedisModuleCtx *ctx, void *privdata, RedisModuleString **err) {
+    REDISMODULE_NOT_USED(ctx);
+    REDISMODULE_NOT_USED(privdata);
+    REDISMODULE_NOT_USED(err);
+    randSeed(&moduleRng, rngSeed);
+    return REDISMODULE_OK;
+}
+
+
+/* banditucb.compact config, only applies to bandits created afterwards */
+int getCompactConfig(const char *name, void *privdata) {
+    REDISMODULE_NOT_USED(name);
+    REDISMODULE_NOT_USED(privdata);
+    return compactEncoding;
+}
+
+
+int setCompactConfig(const char *name, int val, void *privdata, RedisModuleString **err) {
+    REDISMODULE_NOT_USED(name);
+    REDISMODULE_NOT_USED(privdata);
+    REDISMODULE_NOT_USED(err);
+    compactEncoding = val;
+    return REDISMODULE_OK;
+}
+
+
+/* banditucb.sparse-arms config, only applies to bandits created afterwards */
+long long getSparseArmsConfig(const char *name, void *privdata) {
+    REDISMODULE_NOT_USED(name);
+    REDISMODULE_NOT_USED(privdata);
+    return sparseArms;
+}
+
+
+int setSparseArmsConfig(const char *name, long long val, void *privdata, RedisModuleString **err) {
+    REDISMODULE_NOT_USED(name);
+    REDISMODULE_NOT_USED(privdata);
+    REDISMODULE_NOT_USED(err);
+    sparseArms = val;
+    return REDISMODULE_OK;
+}
+
+
+/* banditucb.pending-ttl config, pending pulls already kept expire with the
+ * ttl they were picked with */
+long long getPendingTtlConfig(const char *name, void *privdata) {
+    REDISMODULE_NOT_USED(name);
+    REDISMODULE_NOT_USED(privdata);
+    return pendingTtl;
+}
+
+
+int setPendingTtlConfig(const char *name, long long val, void *privdata, RedisModuleString **err) {
+    REDISMODULE_NOT_USED(name);
+    REDISMODULE_NOT_USED(privdata);
+    REDISMODULE_NOT_USED(err);
+    pendingTtl = val;
+    return REDISMODULE_OK;
+}
+
+
+/* banditucb.pending-max config, rings already larger keep their pulls */
+long long getPendingMaxConfig(const char *name, void *privdata) {
+    REDISMODULE_NOT_USED(name);
+    REDISMODULE_NOT_USED(privdata);
+    return pendingMax;
+}
+
+
+int setPendingMaxConfig(const char *name, long long val, void *privdata, RedisModuleString **err) {
+    REDISMODULE_NOT_USED(name);
+    REDISMODULE_NOT_USED(privdata);
+    REDISMODULE_NOT_USED(err);
+    pendingMax = val;
+    return REDISMODULE_OK;
+}
+
+
+/* banditucb.tickets and banditucb.ticket-ttl configs. The ring size only
+ * applies to bandits getting their first ticket afterwards */
+long long getTicketsConfig(const char *name, void *privdata) {
+    REDISMODULE_NOT_USED(name);
+    REDISMODULE_NOT_USED(privdata);
+    return ticketRingSize;
+}
+
+
+int setTicketsConfig(const char *name, long long val, void *privdata, RedisModuleString **err) {
+    REDISMODULE_NOT_USED(name);
+    REDISMODULE_NOT_USED(privdata);
+    REDISMODULE_NOT_USED(err);
+    ticketRingSize = val;
+    return REDISMODULE_OK;
+}
+
+
+long long getTicketTtlConfig(const char *name, void *privdata) {
+    REDISMODULE_NOT_USED(name);
+    REDISMODULE_NOT_USED(privdata);
+    return ticketTtl;
+}
+
+
+int setTicketTtlConfig(const char *name, long long val, void *privdata, RedisModuleString **err) {
+    REDISMODULE_NOT_USED(name);
+    REDISMODULE_NOT_USED(privdata);
+    REDISMODULE_NOT_USED(err);
+    ticketTtl = val;
+    return REDISMODULE_OK;
+}
+
+
+/* banditucb.fast-math and banditucb.fast-math-threshold configs.
+ * Bounds already cached stay as they are until their bandit changes */
+int getFastMathConfig(const char *name, void *privdata) {
+    REDISMODULE_NOT_USED(name);
+    REDISMODULE_NOT_USED(privdata);
+    return fastMath;
+}
+
+
+int setFastMathConfig(const char *name, int val, void *privdata, RedisModuleString **err) {
+    REDISMODULE_NOT_USED(name);
+    REDISMODULE_NOT_USED(privdata);
+    REDISMODULE_NOT_USED(err);
+    fastMath = val;
+    return REDISMODULE_OK;
+}
+
+
+long long getFastMathThresholdConfig(const char *name, void *privdata) {
+    REDISMODULE_NOT_USED(name);
+    REDISMODULE_NOT_USED(privdata);
+    return fastMathThreshold;
+}
+
+
+int setFastMathThresholdConfig(const char *name, long long val, void *privdata, RedisModuleString **err) {
+    REDISMODULE_NOT_USED(name);
+    REDISMODULE_NOT_USED(privdata);
+    REDISMODULE_NOT_USED(err);
+    fastMathThreshold = val;
+    return REDISMODULE_OK;
+}
+
+
+/* (re)build the table for the threshold, or free it when fast math is off */
+void buildRsqrtTable(void) {
+    RedisModule_Free(rsqrtTable);
+    rsqrtTable = NULL;
+    rsqrtTableMax = 0;
+    if (fastMath) {
+      rsqrtTable = RedisModule_Alloc((fastMathThreshold + 1) * sizeof(float));
+      rsqrtTable[0] = INFINITY;
+      for (long long n = 1; n <= fastMathThreshold; ++n) {
+	rsqrtTable[n] = 1.0 / sqrt(n);
+      }
+      rsqrtTableMax = fastMathThreshold;
+    }
+}
+
+
+int applyFastMathConfig(RedisModuleCtx *ctx, void *privdata, RedisModuleString **err) {
+    REDISMODULE_NOT_USED(ctx);
+    REDISMODULE_NOT_USED(privdata);
+    REDISMODULE_NOT_USED(err);
+    buildRsqrtTable();
+    return REDISMODULE_OK;
+}
+
+
 /* Register and setup everything on load */
 int RedisModule_OnLoad(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
     REDISMODULE_NOT_USED(argv);
@@ -527,9 +3444,66 @@ int RedisModule_OnLoad(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
         .digest = BanditUCBDigest
     };
 
-    BanditUCBType = RedisModule_CreateDataType(ctx,"banditucb",0,&tm);
+    BanditUCBType = RedisModule_CreateDataType(ctx,"banditucb",BANDITUCB_ENCVER,&tm);
     if (BanditUCBType == NULL) return REDISMODULE_ERR;
 
+    selectBoundsKernels();
+    RedisModule_Log(ctx, "verbose", "using %s bounds kernel", boundsKernelName);
+
+    /* configs came with Redis 7, older servers run with the defaults */
+    if (RedisModule_RegisterNumericConfig != NULL) {
+      if (RedisModule_RegisterNumericConfig(ctx, "seed", 0, REDISMODULE_CONFIG_DEFAULT,
+					    0, LLONG_MAX, getSeedConfig, setSeedConfig,
+					    applySeedConfig, NULL) == REDISMODULE_ERR)
+          return REDISMODULE_ERR;
+      if (RedisModule_RegisterBoolConfig(ctx, "compact", 0, REDISMODULE_CONFIG_DEFAULT,
+				         getCompactConfig, setCompactConfig,
+				         NULL, NULL) == REDISMODULE_ERR)
+          return REDISMODULE_ERR;
+      if (RedisModule_RegisterNumericConfig(ctx, "sparse-arms", 65536,
+					    REDISMODULE_CONFIG_DEFAULT, 0, MAX_ARMS,
+					    getSparseArmsConfig, setSparseArmsConfig,
+					    NULL, NULL) == REDISMODULE_ERR)
+          return REDISMODULE_ERR;
+      if (RedisModule_RegisterNumericConfig(ctx, "pending-ttl", 0,
+					    REDISMODULE_CONFIG_DEFAULT, 0, INT_MAX,
+					    getPendingTtlConfig, setPendingTtlConfig,
+					    NULL, NULL) == REDISMODULE_ERR)
+          return REDISMODULE_ERR;
+      if (RedisModule_RegisterNumericConfig(ctx, "pending-max", 65536,
+					    REDISMODULE_CONFIG_DEFAULT, 1, PENDING_MAX_PULLS,
+					    getPendingMaxConfig, setPendingMaxConfig,
+					    NULL, NULL) == REDISMODULE_ERR)
+          return REDISMODULE_ERR;
+      if (RedisModule_RegisterNumericConfig(ctx, "tickets", 1024,
+					    REDISMODULE_CONFIG_DEFAULT, 1, TICKETS_MAX,
+					    getTicketsConfig, setTicketsConfig,
+					    NULL, NULL) == REDISMODULE_ERR)
+          return REDISMODULE_ERR;
+      if (RedisModule_RegisterNumericConfig(ctx, "ticket-ttl", 0,
+					    REDISMODULE_CONFIG_DEFAULT, 0, INT_MAX,
+					    getTicketTtlConfig, setTicketTtlConfig,
+					    NULL, NULL) == REDISMODULE_ERR)
+          return REDISMODULE_ERR;
+      if (RedisModule_RegisterBoolConfig(ctx, "fast-math", 0, REDISMODULE_CONFIG_DEFAULT,
+				         getFastMathConfig, setFastMathConfig,
+				         applyFastMathConfig, NULL) == REDISMODULE_ERR)
+          return REDISMODULE_ERR;
+      if (RedisModule_RegisterNumericConfig(ctx, "fast-math-threshold", 65536,
+					    REDISMODULE_CONFIG_DEFAULT, 1, 1 << 24,
+					    getFastMathThresholdConfig, setFastMathThresholdConfig,
+					    applyFastMathConfig, NULL) == REDISMODULE_ERR)
+          return REDISMODULE_ERR;
+      if (RedisModule_LoadConfigs(ctx) == REDISMODULE_ERR)
+          return REDISMODULE_ERR;
+    } else {
+      RedisModule_Log(ctx, "warning", "configs need Redis 7 or later, using the defaults");
+    }
+
+    /* apply callbacks only run on CONFIG SET, not on load */
+    randSeed(&moduleRng, rngSeed);
+    buildRsqrtTable();
+
     if (RedisModule_CreateCommand(ctx,"banditucb.init",
         BanditUCBInit_RedisCommand,"write deny-oom",1,1,1) == REDISMODULE_ERR)
         return REDISMODULE_ERR;
@@ -538,6 +3512,26 @@ int RedisModule_OnLoad(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
         BanditUCBAdd_RedisCommand,"write deny-oom",1,1,1) == REDISMODULE_ERR)
         return REDISMODULE_ERR;
 
+    if (RedisModule_CreateCommand(ctx,"banditucb.reward",
+        BanditUCBReward_RedisCommand,"write deny-oom",1,1,1) == REDISMODULE_ERR)
+        return REDISMODULE_ERR;
+
+    if (RedisModule_CreateCommand(ctx,"banditucb.addagg",
+        BanditUCBAddAgg_RedisCommand,"write deny-oom",1,1,1) == REDISMODULE_ERR)
+        return REDISMODULE_ERR;
+
+    if (RedisModule_CreateCommand(ctx,"banditucb.addblob",
+        BanditUCBAddBlob_RedisCommand,"write deny-oom",1,1,1) == REDISMODULE_ERR)
+        return REDISMODULE_ERR;
+
+    if (RedisModule_CreateCommand(ctx,"banditucb.madd",
+        BanditUCBMAdd_RedisCommand,"write deny-oom",1,1,1) == REDISMODULE_ERR)
+        return REDISMODULE_ERR;
+
+    if (RedisModule_CreateCommand(ctx,"banditucb.maddkeys",
+        BanditUCBMAddKeys_RedisCommand,"write deny-oom",1,-1,3) == REDISMODULE_ERR)
+        return REDISMODULE_ERR;
+
     if (RedisModule_CreateCommand(ctx,"banditucb.set",
         BanditUCBSet_RedisCommand,"write deny-oom",1,1,1) == REDISMODULE_ERR)
         return REDISMODULE_ERR;
@@ -546,6 +3540,61 @@ int RedisModule_OnLoad(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
         BanditUCBPick_RedisCommand,"readonly",1,1,1) == REDISMODULE_ERR)
         return REDISMODULE_ERR;
 
+    if (RedisModule_CreateCommand(ctx,"banditucb.pickn",
+        BanditUCBPickN_RedisCommand,"readonly",1,1,1) == REDISMODULE_ERR)
+        return REDISMODULE_ERR;
+
+    if (RedisModule_CreateCommand(ctx,"banditucb.pickbatch",
+        BanditUCBPickBatch_RedisCommand,"readonly",1,1,1) == REDISMODULE_ERR)
+        return REDISMODULE_ERR;
+
+    if (RedisModule_CreateCommand(ctx,"banditucb.mpick",
+        BanditUCBMPick_RedisCommand,"readonly",1,-1,1) == REDISMODULE_ERR)
+        return REDISMODULE_ERR;
+
+    /* key specs for cluster aware clients, servers before 7 do without */
+    if (RedisModule_SetCommandInfo != NULL) {
+      // picks keep pending pulls, state that is neither persisted nor
+      // replicated but still written
+      RedisModuleCommandKeySpec mpickKeySpecs[] = {
+        {
+          .flags = REDISMODULE_CMD_KEY_RW | REDISMODULE_CMD_KEY_ACCESS | REDISMODULE_CMD_KEY_UPDATE,
+          .begin_search_type = REDISMODULE_KSPEC_BS_INDEX,
+          .bs.index.pos = 1,
+          .find_keys_type = REDISMODULE_KSPEC_FK_RANGE,
+          .fk.range = {.lastkey = -1, .keystep = 1, .limit = 0}
+        },
+        {0}
+      };
+      const RedisModuleCommandInfo mpickInfo = {
+        .version = REDISMODULE_COMMAND_INFO_VERSION,
+        .arity = -2,
+        .key_specs = mpickKeySpecs
+      };
+      if (RedisModule_SetCommandInfo(RedisModule_GetCommand(ctx,"banditucb.mpick"),
+                                     &mpickInfo) == REDISMODULE_ERR)
+        return REDISMODULE_ERR;
+
+      RedisModuleCommandKeySpec maddkeysKeySpecs[] = {
+        {
+          .flags = REDISMODULE_CMD_KEY_RW | REDISMODULE_CMD_KEY_UPDATE,
+          .begin_search_type = REDISMODULE_KSPEC_BS_INDEX,
+          .bs.index.pos = 1,
+          .find_keys_type = REDISMODULE_KSPEC_FK_RANGE,
+          .fk.range = {.lastkey = -1, .keystep = 3, .limit = 0}
+        },
+        {0}
+      };
+      const RedisModuleCommandInfo maddkeysInfo = {
+        .version = REDISMODULE_COMMAND_INFO_VERSION,
+        .arity = -4,
+        .key_specs = maddkeysKeySpecs
+      };
+      if (RedisModule_SetCommandInfo(RedisModule_GetCommand(ctx,"banditucb.maddkeys"),
+                                     &maddkeysInfo) == REDISMODULE_ERR)
+        return REDISMODULE_ERR;
+    }
+
     if (RedisModule_CreateCommand(ctx,"banditucb.counts",
         BanditUCBCounts_RedisCommand,"readonly",1,1,1) == REDISMODULE_ERR)
         return REDISMODULE_ERR;
@@ -557,6 +3606,10 @@ int RedisModule_OnLoad(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
     if (RedisModule_CreateCommand(ctx,"banditucb.bounds",
         BanditUCBBounds_RedisCommand,"readonly",1,1,1) == REDISMODULE_ERR)
         return REDISMODULE_ERR;
+
+    if (RedisModule_CreateCommand(ctx,"banditucb.state",
+        BanditUCBState_RedisCommand,"readonly",1,1,1) == REDISMODULE_ERR)
+        return REDISMODULE_ERR;
     
     return REDISMODULE_OK;
 }